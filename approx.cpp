@@ -0,0 +1,119 @@
+#include "approx.hpp"
+
+#include "process.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+char const *approxName(Approx approx) noexcept {
+    switch (approx) {
+        case Approx::None: return "none";
+        case Approx::Truncated: return "truncated";
+        case Approx::HalfRes: return "half resolution";
+    }
+    return "unknown";
+}
+
+std::optional<Options> approximate(Options const &opts, Approx approx) {
+    auto out = opts;
+    if (approx == Approx::None) return out;
+    // Fewer iterations of a blur blur less, but of anything else they make a different image
+    if (opts.alg != Alg::Gauss && opts.alg != Alg::Avg && opts.alg != Alg::Binomial && opts.alg != Alg::Diffusion)
+        return std::nullopt;
+
+    // Past 2σ, the rest of a Gaussian only holds about 5% of its weight
+    if (out.alg == Alg::Gauss) out.matsize = std::min(out.matsize, std::max(3, 2 * int(std::ceil(2 * out.sigma)) + 1));
+    out.iterations = (out.iterations + 1) / 2;
+    if (approx == Approx::Truncated) {
+        if (out.matsize == opts.matsize && out.iterations == opts.iterations) return std::nullopt;
+        return out;
+    }
+
+    // Only blurs are about the same at a lower resolution, with half the radius
+    switch (out.alg) {
+        case Alg::Gauss:
+            out.sigma /= 2;
+            out.matsize = std::max(3, (out.matsize / 2) | 1);
+            return out;
+        case Alg::Avg:
+            if (out.matsize < 5) return std::nullopt;
+            out.matsize = (out.matsize / 2) | 1;
+            return out;
+        case Alg::Binomial:
+            if (out.matsize < 5) return std::nullopt;
+            out.matsize = 3;
+            return out;
+        case Alg::Sobel:
+        case Alg::Custom:
+        case Alg::Diffusion:
+        case Alg::Laplace:
+        case Alg::Plugin:
+        case Alg::None: break;
+    }
+    return std::nullopt;
+}
+
+double approxCost(Options const &opts, Approx approx) {
+    if (approx != Approx::HalfRes) return byteCost(opts);
+    // A quarter of the pixels, plus scaling down and back up
+    static constexpr double scaling = 2.;
+    return byteCost(opts) / 4 + scaling;
+}
+
+std::vector<std::uint8_t> halveImage(Image const &image) {
+    auto const [data, width, height, channels] = image;
+    auto const half_width = (width + 1) / 2;
+    auto const half_height = (height + 1) / 2;
+    auto out = std::vector<std::uint8_t>(size_t(half_width) * size_t(half_height) * size_t(channels));
+    auto const row_len = size_t(width) * size_t(channels);
+#pragma omp parallel for
+    for (int y = 0; y < half_height; y++) {
+        auto const *const top = data + size_t(2 * y) * row_len;
+        // The last row or column is repeated for odd sizes
+        auto const *const bottom = 2 * y + 1 < height ? top + row_len : top;
+        auto *const dst = out.data() + size_t(y) * size_t(half_width) * size_t(channels);
+        for (int x = 0; x < half_width; x++) {
+            auto const left = size_t(2 * x) * size_t(channels);
+            auto const right = 2 * x + 1 < width ? left + size_t(channels) : left;
+            for (size_t c = 0; c < size_t(channels); c++) {
+                auto const sum = top[left + c] + top[right + c] + bottom[left + c] + bottom[right + c];
+                dst[size_t(x) * size_t(channels) + c] = std::uint8_t((sum + 2) / 4);
+            }
+        }
+    }
+    return out;
+}
+
+void expandImage(Image const &small, int width, int height, std::uint8_t out[]) {
+    auto const [data, small_width, small_height, channels] = small;
+    auto const small_row = size_t(small_width) * size_t(channels);
+    // Pixel centres of the small image fall between pairs of output pixels
+    auto const source = [](int x, int size, int &lo, int &hi, float &frac) {
+        auto const pos = std::clamp((float(x) + .5f) / 2 - .5f, 0.f, float(size - 1));
+        lo = int(pos);
+        hi = std::min(lo + 1, size - 1);
+        frac = pos - float(lo);
+    };
+#pragma omp parallel for
+    for (int y = 0; y < height; y++) {
+        int y0, y1;
+        float fy;
+        source(y, small_height, y0, y1, fy);
+        auto const *const row0 = data + size_t(y0) * small_row;
+        auto const *const row1 = data + size_t(y1) * small_row;
+        auto *const dst = out + size_t(y) * size_t(width) * size_t(channels);
+        for (int x = 0; x < width; x++) {
+            int x0, x1;
+            float fx;
+            source(x, small_width, x0, x1, fx);
+            for (size_t c = 0; c < size_t(channels); c++) {
+                auto const at = [&](std::uint8_t const *row, int col) {
+                    return float(row[size_t(col) * size_t(channels) + c]);
+                };
+                auto const upper = at(row0, x0) + (at(row0, x1) - at(row0, x0)) * fx;
+                auto const lower = at(row1, x0) + (at(row1, x1) - at(row1, x0)) * fx;
+                dst[size_t(x) * size_t(channels) + c] = std::uint8_t(upper + (lower - upper) * fy + .5f);
+            }
+        }
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef APPROX_HPP
+#define APPROX_HPP
+
+#include "args.hpp"
+#include "filter.hpp"
+
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+// Cheaper ways of applying a filter which give a close but not identical result, in order of increasing error
+enum struct Approx {
+    None,
+    Truncated,  // Gaussian kernels cut off at 2σ, and half the iterations, for blurs only
+    HalfRes,    // as Truncated, on the image scaled to half its size and back, for blurs only
+};
+
+char const *approxName(Approx approx) noexcept;
+
+// The options which apply the filter in opts at the given level, or nullopt if that level would not make it any cheaper
+// or would not give a close result, as for anything but blurs
+std::optional<Options> approximate(Options const &opts, Approx approx);
+
+// Rough amount of work per byte of output for the options returned by approximate, in the units of byteCost
+double approxCost(Options const &opts, Approx approx);
+
+// Image scaled to half its width and height, rounding up, by averaging 2×2 blocks
+std::vector<std::uint8_t> halveImage(Image const &image);
+
+// Scales small, which came from halveImage, back up to width×height by interpolating bilinearly
+void expandImage(Image const &small, int width, int height, std::uint8_t out[]);
+
+#endif  // APPROX_HPP
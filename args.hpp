@@ -1,22 +1,74 @@
 #ifndef ARGS_HPP
 #define ARGS_HPP
 
+#include "border.hpp"
 #include "io.hpp"
 #include "print.hpp"
+#include "temporal.hpp"
 
 #include <algorithm>
+#include <cctype>
+#include <cstdint>
 #include <filesystem>
+#include <format>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <utility>
+#include <vector>
 namespace fs = std::filesystem;
 
-enum struct Alg { None, Gauss, Sobel, Custom, Avg };
+enum struct Alg { None, Gauss, Sobel, Custom, Avg, Diffusion, Binomial, Laplace, Plugin };
 
-#define DIE(...)              \
-    do {                      \
-        println(__VA_ARGS__); \
-        exit(1);              \
-    } while (false)
+// Everything given on the command line apart from the files
+struct Options {
+    int matsize;
+    int channels;
+    int sobel_type;
+    double sigma;
+    std::uint8_t th_lo;
+    std::uint8_t th_hi;
+    char const *custom_mat;
+    Alg alg;
+    Border border;
+    int iterations;
+    double kappa;
+    double lambda;
+    char const *plugin;
+    char const *plugin_opts;
+    char const *cache_dir;
+    bool cache_outputs;
+    bool diff_frames;
+    bool watch;
+    Temporal temporal;
+    int window;
+    double time_sigma;
+    int shards;
+    int deadline;
+    int priority;
+    // Extension, without the dot, of the format images in a directory are converted to, or nullptr to keep theirs
+    char const *convert_to;
+};
 
-inline fs::path checkExt(char const *filename) noexcept {
+// Fields of Options which point to strings, which have to be copied for options to outlive the arguments
+inline constexpr char const *Options::*option_strings[] = {
+    &Options::custom_mat,
+    &Options::plugin,
+    &Options::plugin_opts,
+    &Options::cache_dir,
+    &Options::convert_to,
+};
+
+// Thrown by DIE while parsing, so that bad arguments in a request to the server do not stop it
+struct ArgsError : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+#define DIE(...) throw ArgsError(std::format(__VA_ARGS__))
+
+inline fs::path checkExt(char const *filename) {
     auto const path = fs::path(filename);
     auto const ext = path.extension();
     if (ext != ".jpg" && ext != ".tga" && ext != ".bmp" && ext != ".png") DIE("Unknown file extension {}", ext.c_str());
@@ -24,32 +76,104 @@ inline fs::path checkExt(char const *filename) noexcept {
     return path;
 }
 
-inline auto args(int argc, char **argv) noexcept {
+// Throws ArgsError with the reason if the command line is not valid
+inline std::tuple<char *, char *, Options> parseArgs(int argc, char **argv) {
     auto matsize = 5;
     auto channels = 0;
     auto sigma = 1.4;
     auto sobel_type = 0;
     auto alg = Alg::None;
+    auto border = Border::Reflect101;
+    auto iterations = 1;
+    auto kappa = 15.;
+    auto lambda = 0.2;
     int th_hi = 255;
     int th_lo = 0;
     char const *custom_mat = nullptr;
+    char const *plugin = nullptr;
+    char const *plugin_opts = nullptr;
+    char const *cache_dir = nullptr;
+    auto cache_outputs = false;
+    auto diff_frames = false;
+    auto watch = false;
+    auto temporal = Temporal::None;
+    auto window = 5;
+    auto time_sigma = 1.;
+    auto shards = 1;
+    auto deadline = 0;
+    auto priority = 0;
+    char const *convert_to = nullptr;
 
     if (argc < 3) {
         DIE(R"(Usage: {0} INFILE OUTFILE [OPTS]
+       {0} --jobs FILE [-w|--workers N] [--memory MB]
+       {0} --serve SOCKET [--decoded-cache MB] [--metrics FILE] [--memory MB]
 
         -m|--matsize N              set matrix size, default: {1}
         -s|--sigma N                set sigma, default: {2}
            --sobel-type N           Sobel filter type (0, 1 or 2), default: {3}
         -t|--threshold N,N          upper and lower threshold values, default: {4},{5}
         -x|--custom-matrix MAT      specify the matrix to use use with custom algorythm, default: none
-        -a|--alg ENUM               pick algorythm, one of gauss, sobel, avg, custom or none, default: none
+        -a|--alg ENUM               pick algorythm, one of gauss, binomial, sobel, laplace, avg, custom, diffusion
+                                    or none, default: none
         -c|--channels N             set number of channels to output, default: same as input image
+        -p|--plugin PATH            filter with a plugin loaded from a shared object (see plugin.h), default: none
+           --plugin-opt STR         options passed to the plugin, default: none
+        -b|--border ENUM            how to sample outside of the image, one of reflect, reflect101, clamp, wrap
+                                    or constant (zero), default: {6}
+        -i|--iterations N           apply the filter N times, default: {7}
+        -k|--kappa N                diffusion edge threshold, gradients much larger than this are preserved,
+                                    default: {8}
+           --lambda N               diffusion rate per iteration, 0-0.25, default: {9}
+           --cache-dir DIR          keep generated code and tuning decisions in DIR for later runs, default: none
+           --cache-outputs          also keep outputs in the cache directory, and reuse them when the same input is
+                                    filtered with the same options again
+           --diff-frames            when filtering a sequence of images, only refilter the tiles which differ from the
+                                    previous image of the same size, default: off
+           --watch                  with a directory as INFILE, keep running and filter images as they are written
+                                    to it, until interrupted
+           --convert-to EXT         with a directory as INFILE, write every image as jpg, png, tga or bmp rather than
+                                    in its own format, default: none
+           --temporal ENUM          for Y4M streams and shared memory, first combine each frame with the ones before
+                                    it, one of mean, ema (exponential moving average), gauss or none, default: {10}
+           --window N               number of frames the temporal filter takes in, default: {11}
+           --time-sigma N           sigma of the temporal Gaussian, in frames, default: {12}
+           --shards N               filter each image in N worker processes, each taking a band of rows and an even
+                                    share of the CPUs, default: {13}
+           --deadline MS            for requests to --serve, the time after arriving by which a request should be
+                                    done, which it is filtered approximately to meet if need be, default: none
+           --priority N             for requests to --serve, higher priorities are served first, and equal ones
+                                    earliest deadline first, default: {14}
 
 
         note that a dash (-) can be used insted of INFILE or OUTFILE to use stdin and stdout respectively
 
+        with --jobs, FILE lists one job per line as INFILE OUTFILE [OPTS], and the jobs are scheduled over N worker
+        threads (default: one per core) by their estimated cost, largest first. With --memory, jobs only start once
+        the memory they are estimated to need fits into MB megabytes along with the jobs already running
+
+        with --serve, requests are taken from clients of the Unix socket SOCKET, one per connection as a line of
+        INFILE OUTFILE [OPTS], and answered with a line holding the exit status. Decoded images are kept in memory,
+        up to MB megabytes (default: 256), for when the same image is filtered again. With --metrics, request counts,
+        latencies, queue depth, cache hits and CPU use are written to FILE in the Prometheus text format every second.
+        With --memory, decoded images are dropped to make room for each request, and requests which would need more
+        than MB megabytes on their own are refused
+
+        if INFILE is a directory, every image in it (and its subdirectories) is filtered into the same place under the
+        directory OUTFILE. A manifest in OUTFILE records what each output was made from, and images which have not
+        changed since they were last filtered with the same options are skipped. Images are filtered in the order of
+        their names, which makes up the sequence for --diff-frames
+
+        shm:NAME can be used instead of both INFILE and OUTFILE to exchange frames with other processes through POSIX
+        shared memory, see shm.h
+
         -.extension can be used to force a particular input or output format. E.g:
             {0} -.jpg -.png -a none # convert image from jpg to png
+            {0} scans/ pngs/ --convert-to png # convert every image in scans to png
+
+        .y4m files are YUV4MPEG2 video streams, which are filtered frame by frame as they are read, one plane at a
+        time. The threshold only applies to luma, and --channels and --cache-outputs do not apply. E.g:
+            ffmpeg -i in.mp4 -f yuv4mpegpipe - | {0} -.y4m -.y4m -a gauss | ffmpeg -i - out.mp4
 
         if no extension is specified, input format is obtained from file signature
         and output format is the same as input format
@@ -84,7 +208,16 @@ inline auto args(int argc, char **argv) noexcept {
             sigma,
             sobel_type,
             th_lo,
-            th_hi);
+            th_hi,
+            borderName(border),
+            iterations,
+            kappa,
+            lambda,
+            temporalName(temporal),
+            window,
+            time_sigma,
+            shards,
+            priority);
     }
 
 
@@ -129,21 +262,103 @@ inline auto args(int argc, char **argv) noexcept {
             } else if (arg == "-x" || arg == "--custom-matrix") {
                 getNext();
                 custom_mat = argv[i];
+            } else if (arg == "-p" || arg == "--plugin") {
+                getNext();
+                plugin = argv[i];
+                alg = Alg::Plugin;
+            } else if (arg == "--plugin-opt") {
+                getNext();
+                plugin_opts = argv[i];
+            } else if (arg == "--cache-dir") {
+                getNext();
+                cache_dir = argv[i];
+            } else if (arg == "--cache-outputs") {
+                cache_outputs = true;
+            } else if (arg == "--convert-to") {
+                getNext();
+                convert_to = argv[i] + (argv[i][0] == '.');
+                auto const ext = std::string_view(convert_to);
+                if (ext != "jpg" && ext != "png" && ext != "tga" && ext != "bmp")
+                    DIE("Cannot convert to {}, expected one of jpg, png, tga or bmp", argv[i]);
+            } else if (arg == "--diff-frames") {
+                diff_frames = true;
+            } else if (arg == "--watch") {
+#ifndef __linux__
+                DIE("--watch is only supported on Linux");
+#endif
+                watch = true;
+            } else if (arg == "--temporal") {
+                auto &next = getNext();
+                std::transform(next.begin(), next.end(), next.begin(), [](auto ch) { return std::tolower(ch); });
+                if (next == "mean")
+                    temporal = Temporal::Mean;
+                else if (next == "ema")
+                    temporal = Temporal::Ema;
+                else if (next == "gauss")
+                    temporal = Temporal::Gauss;
+                else if (next == "none")
+                    temporal = Temporal::None;
+                else
+                    DIE("Unknown temporal filter {}", arg);
+            } else if (arg == "--window") {
+                window = std::stoi(getNext());
+                if (window < 1) DIE("The temporal window has to be at least 1 frame");
+            } else if (arg == "--time-sigma") {
+                time_sigma = std::stod(getNext());
+                if (time_sigma <= 0) DIE("time sigma has to be positive");
+            } else if (arg == "--shards") {
+                shards = std::stoi(getNext());
+                if (shards < 1) DIE("Cannot have fewer than 1 shard");
+            } else if (arg == "--deadline") {
+                deadline = std::stoi(getNext());
+                if (deadline < 1) DIE("The deadline has to be positive");
+            } else if (arg == "--priority") {
+                priority = std::stoi(getNext());
             } else if (arg == "-a" || arg == "--alg") {
                 auto &next = getNext();
                 std::transform(next.begin(), next.end(), next.begin(), [](auto ch) { return std::tolower(ch); });
                 if (next == "gauss")
                     alg = Alg::Gauss;
+                else if (next == "binomial")
+                    alg = Alg::Binomial;
                 else if (next == "sobel")
                     alg = Alg::Sobel;
+                else if (next == "laplace")
+                    alg = Alg::Laplace;
                 else if (next == "custom")
                     alg = Alg::Custom;
                 else if (next == "avg")
                     alg = Alg::Avg;
+                else if (next == "diffusion")
+                    alg = Alg::Diffusion;
                 else if (next == "none")
                     alg = Alg::None;
                 else
                     DIE("Unknown algorithm {}", arg);
+            } else if (arg == "-i" || arg == "--iterations") {
+                iterations = std::stoi(getNext());
+                if (iterations < 1) DIE("Cannot apply the filter fewer than 1 time");
+            } else if (arg == "-k" || arg == "--kappa") {
+                kappa = std::stod(getNext());
+                if (kappa <= 0) DIE("kappa has to be positive");
+            } else if (arg == "--lambda") {
+                lambda = std::stod(getNext());
+                if (lambda <= 0 || lambda > 0.25) DIE("lambda has to be greater than 0 and at most 0.25");
+            } else if (arg == "-b" || arg == "--border") {
+                auto &next = getNext();
+                std::transform(next.begin(), next.end(), next.begin(), [](auto ch) { return std::tolower(ch); });
+                if (next == "reflect")
+                    border = Border::Reflect;
+                else if (next == "reflect101")
+                    border = Border::Reflect101;
+                else if (next == "clamp")
+                    border = Border::Clamp;
+                else if (next == "wrap")
+                    border = Border::Wrap;
+                else if (next == "constant")
+                    border = Border::Constant;
+                else
+                    DIE("Unknown border mode {}", arg);
             } else
                 DIE("Unrecognised argument '{}'", arg);
         } catch (std::invalid_argument const &e) {
@@ -157,19 +372,173 @@ inline auto args(int argc, char **argv) noexcept {
         matsize = int(std::count(sv.begin(), sv.end(), '|') + !sv.ends_with('|'));
     }
     if (alg == Alg::Custom && !custom_mat) DIE("custom algorythm requires specifying a matrix");
+    if (alg == Alg::Plugin && !plugin) DIE("plugin algorythm is selected with --plugin");
+    if (alg == Alg::Binomial && matsize != 3 && matsize != 5) DIE("binomial blur is only available in sizes 3 and 5");
+    if (cache_outputs && !cache_dir) DIE("--cache-outputs requires --cache-dir");
+    if (std::error_code ec; watch && !fs::is_directory(argv[1], ec)) DIE("--watch requires a directory as INFILE");
+    if (std::error_code ec; convert_to && !fs::is_directory(argv[1], ec))
+        DIE("--convert-to requires a directory as INFILE");
 
-    auto input_file = File::open(argv[1], File::Mode::Read);
-    auto outout_file = File::open(argv[2], File::Mode::Write, input_file.type);
-    return std::make_tuple(std::move(input_file),
-        std::move(outout_file),
-        matsize,
-        channels,
-        sobel_type,
-        sigma,
-        std::uint8_t(th_lo),
-        std::uint8_t(th_hi),
-        custom_mat,
-        alg);
+    return std::make_tuple(argv[1],
+        argv[2],
+        Options {
+            matsize,
+            channels,
+            sobel_type,
+            sigma,
+            std::uint8_t(th_lo),
+            std::uint8_t(th_hi),
+            custom_mat,
+            alg,
+            border,
+            iterations,
+            kappa,
+            lambda,
+            plugin,
+            plugin_opts,
+            cache_dir,
+            cache_outputs,
+            diff_frames,
+            watch,
+            temporal,
+            window,
+            time_sigma,
+            shards,
+            deadline,
+            priority,
+            convert_to,
+        });
+}
+
+// Prints the reason, after where if given, and returns nullopt if the command line is not valid
+inline std::optional<std::tuple<char *, char *, Options>> tryArgs(
+    int argc, char **argv, std::string_view where = {}) noexcept {
+    try {
+        return parseArgs(argc, argv);
+    } catch (ArgsError const &e) {
+        if (where.empty())
+            println("{}", e.what());
+        else
+            println("{}: {}", where, e.what());
+        return std::nullopt;
+    }
+}
+
+// Exits if the command line is not valid
+inline auto args(int argc, char **argv) noexcept {
+    auto parsed = tryArgs(argc, argv);
+    if (!parsed) exit(1);
+    return std::move(*parsed);
+}
+
+// Splits a line into arguments at whitespace, keeping quoted parts together. Returns false for an unterminated quote.
+inline bool splitArgs(std::string_view line, std::vector<std::string> &out) {
+    out.clear();
+    std::string arg;
+    auto in_arg = false;
+    char quote = 0;
+    for (auto const ch : line) {
+        if (quote) {
+            if (ch == quote)
+                quote = 0;
+            else
+                arg += ch;
+        } else if (ch == '\'' || ch == '"') {
+            quote = ch;
+            in_arg = true;
+        } else if (std::isspace(std::uint8_t(ch))) {
+            if (in_arg) out.push_back(std::move(arg));
+            arg.clear();
+            in_arg = false;
+        } else {
+            arg += ch;
+            in_arg = true;
+        }
+    }
+    if (in_arg) out.push_back(std::move(arg));
+    return !quote;
+}
+
+// A size given in megabytes, in bytes
+inline size_t parseMegabytes(char const *arg) {
+    auto megabytes = 0;
+    try {
+        megabytes = std::stoi(arg);
+    } catch (std::exception const &e) {
+        DIE("Invalid number '{}': {}", arg, e.what());
+    }
+    if (megabytes < 0) DIE("A size cannot be negative");
+    return size_t(megabytes) << 20;
+}
+
+struct JobsOptions {
+    char const *file;
+    // 0 for one per core
+    int workers;
+    // Budget for the jobs running at the same time, in bytes, or 0 for no limit
+    size_t memory;
+};
+
+// Returns the job file and its settings if the program was called with --jobs
+inline std::optional<JobsOptions> jobsArgs(int argc, char **argv) noexcept {
+    if (argc < 3 || argv[1] != std::string_view("--jobs")) return std::nullopt;
+    auto workers = 0;
+    size_t memory = 0;
+    try {
+        for (auto i = 3; i < argc; i += 2) {
+            auto const arg = std::string_view(argv[i]);
+            if (i + 1 == argc) DIE("Expected --jobs FILE [-w|--workers N] [--memory MB]");
+            if (arg == "-w" || arg == "--workers") {
+                try {
+                    workers = std::stoi(argv[i + 1]);
+                } catch (std::exception const &e) {
+                    DIE("Invalid number '{}': {}", argv[i + 1], e.what());
+                }
+                if (workers < 1) DIE("Cannot have fewer than 1 worker");
+            } else if (arg == "--memory")
+                memory = parseMegabytes(argv[i + 1]);
+            else
+                DIE("Expected --jobs FILE [-w|--workers N] [--memory MB]");
+        }
+    } catch (ArgsError const &e) {
+        println("{}", e.what());
+        exit(1);
+    }
+    return JobsOptions {argv[2], workers, memory};
+}
+
+struct ServeOptions {
+    char const *socket;
+    // Budget for decoded images, in bytes
+    size_t cache_bytes;
+    // Where metrics are written to, or nullptr
+    char const *metrics;
+    // Budget for decoded images and the request being served, in bytes, or 0 for no limit
+    size_t memory;
+};
+
+// Returns the socket and its settings if the program was called with --serve
+inline std::optional<ServeOptions> serveArgs(int argc, char **argv) noexcept {
+    if (argc < 3 || argv[1] != std::string_view("--serve")) return std::nullopt;
+    auto serve = ServeOptions {argv[2], size_t(256) << 20, nullptr, 0};
+    try {
+        for (auto i = 3; i < argc; i += 2) {
+            auto const arg = std::string_view(argv[i]);
+            if (i + 1 == argc) DIE("Expected --serve SOCKET [--decoded-cache MB] [--metrics FILE] [--memory MB]");
+            if (arg == "--decoded-cache")
+                serve.cache_bytes = parseMegabytes(argv[i + 1]);
+            else if (arg == "--metrics")
+                serve.metrics = argv[i + 1];
+            else if (arg == "--memory")
+                serve.memory = parseMegabytes(argv[i + 1]);
+            else
+                DIE("Expected --serve SOCKET [--decoded-cache MB] [--metrics FILE] [--memory MB]");
+        }
+    } catch (ArgsError const &e) {
+        println("{}", e.what());
+        exit(1);
+    }
+    return serve;
 }
 
 #undef DIE
@@ -0,0 +1,419 @@
+#define PRINT_FILE stderr
+
+#include "batch.hpp"
+
+#include "defer.hpp"
+#include "fileio.hpp"
+#include "io.hpp"
+#include "process.hpp"
+
+#include "print.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <format>
+#include <fstream>
+#include <sstream>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#ifdef __linux__
+#    include <signal.h>
+#    include <sys/inotify.h>
+#    include <unistd.h>
+#endif
+
+#ifdef _OPENMP
+#    include <omp.h>
+#endif
+
+namespace {
+constexpr char const manifest_name[] = ".convolve-manifest";
+// Reads and writes kept in flight
+constexpr unsigned io_depth = 16;
+// Most input read ahead at a time, in bytes, so that a directory of huge images is not all held in memory at once
+constexpr std::uintmax_t read_ahead_bytes = std::uintmax_t(256) << 20;
+
+// Threads images can be converted on side by side
+size_t converters() noexcept {
+#ifdef _OPENMP
+    return size_t(omp_get_max_threads());
+#else
+    return 1;
+#endif
+}
+
+// Which of them the calling thread is
+size_t converter() noexcept {
+#ifdef _OPENMP
+    return size_t(omp_get_thread_num());
+#else
+    return 0;
+#endif
+}
+
+// What an output was made from
+struct Stamp {
+    std::uint64_t options;
+    std::int64_t mtime;
+    std::uintmax_t size;
+
+    bool operator==(Stamp const &) const = default;
+};
+
+// Keyed by the path of the input relative to the input directory
+using Manifest = std::unordered_map<std::string, Stamp>;
+
+// One line per output: options hash, input mtime and size, then the path. Lines are appended as images are done, so
+// later lines override earlier ones.
+Manifest readManifest(fs::path const &path) {
+    Manifest manifest;
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        Stamp stamp;
+        std::string rel;
+        fields >> std::hex >> stamp.options >> std::dec >> stamp.mtime >> stamp.size;
+        if (!fields || fields.get() != ' ' || !std::getline(fields, rel) || rel.empty()) continue;
+        manifest.insert_or_assign(std::move(rel), stamp);
+    }
+    return manifest;
+}
+
+bool writeEntry(std::FILE *fp, std::string const &rel, Stamp const &stamp) {
+    auto const line = std::format("{:016x} {} {} {}\n", stamp.options, stamp.mtime, stamp.size, rel);
+    return std::fputs(line.c_str(), fp) >= 0 && !std::fflush(fp);
+}
+
+// Replaces the manifest with only the entries in manifest, dropping overridden lines and inputs which are gone
+void compactManifest(fs::path const &path, fs::path const &indir, Manifest const &manifest) {
+    auto tmp = path;
+    tmp += ".tmp";
+    auto *const fp = std::fopen(tmp.c_str(), "w");
+    if (!fp) return;
+    auto ok = true;
+    std::error_code ec;
+    for (auto const &[rel, stamp] : manifest)
+        if (fs::exists(indir / rel, ec)) ok = ok && writeEntry(fp, rel, stamp);
+    if (std::fclose(fp) || !ok)
+        fs::remove(tmp, ec);
+    else
+        fs::rename(tmp, path, ec);
+}
+
+bool isImage(fs::path const &path) {
+    auto const ext = path.extension();
+    return ext == ".jpg" || ext == ".tga" || ext == ".bmp" || ext == ".png";
+}
+
+// Every image under dir, sorted by path. The directory skip is left out, as outputs may be written inside of dir.
+std::vector<fs::directory_entry> findImages(fs::path const &dir, fs::path const &skip, std::error_code &ec) {
+    std::vector<fs::directory_entry> images;
+    std::error_code ignored;
+    auto const end = fs::recursive_directory_iterator();
+    auto it = fs::recursive_directory_iterator(dir, fs::directory_options::skip_permission_denied, ec);
+    for (; !ec && it != end; it.increment(ec)) {
+        if (it->is_directory(ignored) && fs::equivalent(it->path(), skip, ignored)) {
+            it.disable_recursion_pending();
+            continue;
+        }
+        if (it->is_regular_file(ignored) && isImage(it->path())) images.push_back(*it);
+    }
+    std::sort(images.begin(), images.end());
+    return images;
+}
+
+#ifdef __linux__
+std::atomic<bool> interrupted = false;
+
+void interrupt(int) {
+    interrupted = true;
+}
+
+// Reports images as they are written to, or moved into, a directory or any directory under it
+class Watcher {
+public:
+    // Prints the reason and returns nullopt on failure. The directory skip is not watched.
+    static std::optional<Watcher> create(fs::path const &dir, fs::path const &skip) {
+        auto const fd = inotify_init1(IN_CLOEXEC);
+        if (fd < 0) {
+            println("Could not watch {}: {}", dir.c_str(), std::strerror(errno));
+            return std::nullopt;
+        }
+        Watcher watcher(fd, dir, skip);
+        if (!watcher.add(dir)) return std::nullopt;
+
+        // Lets wait() return on ^C, so that the manifest is tidied up
+        struct sigaction action {};
+        action.sa_handler = interrupt;
+        sigaction(SIGINT, &action, nullptr);
+        sigaction(SIGTERM, &action, nullptr);
+        return watcher;
+    }
+
+    Watcher(Watcher const &) = delete;
+    Watcher &operator=(Watcher const &) = delete;
+
+    Watcher(Watcher &&other) noexcept
+            : m_fd(-1) {
+        *this = std::move(other);
+    }
+
+    Watcher &operator=(Watcher &&other) noexcept {
+        if (this == &other) return *this;
+        std::swap(m_fd, other.m_fd);
+        std::swap(m_root, other.m_root);
+        std::swap(m_skip, other.m_skip);
+        std::swap(m_dirs, other.m_dirs);
+        return *this;
+    }
+
+    ~Watcher() noexcept {
+        if (m_fd >= 0) close(m_fd);
+    }
+
+    // Blocks until images were written, returns nullopt once interrupted. Directories created in the meantime are
+    // watched as well, and images already in them are returned along with the rest, each image once, sorted by path.
+    std::optional<std::vector<fs::directory_entry>> wait() {
+        alignas(inotify_event) char buf[1 << 16];
+        if (interrupted) return std::nullopt;
+        ssize_t len;
+        while ((len = read(m_fd, buf, sizeof(buf))) < 0)
+            if (errno != EINTR || interrupted) return std::nullopt;
+
+        std::vector<fs::directory_entry> images;
+        std::error_code ec;
+        for (ssize_t offset = 0; offset < len;) {
+            auto const *const event = reinterpret_cast<inotify_event const *>(buf + offset);
+            offset += ssize_t(sizeof(inotify_event) + event->len);
+            if (event->mask & IN_Q_OVERFLOW) {
+                // Events were lost, anything could have changed
+                auto all = findImages(m_root, m_skip, ec);
+                images.insert(images.end(), all.begin(), all.end());
+                continue;
+            }
+            if (event->mask & IN_IGNORED) m_dirs.erase(event->wd);
+            auto const dir = m_dirs.find(event->wd);
+            if (!event->len || dir == m_dirs.end()) continue;
+
+            auto const path = dir->second / event->name;
+            if (event->mask & IN_ISDIR) {
+                if (fs::equivalent(path, m_skip, ec) || !add(path)) continue;
+                auto const found = findImages(path, m_skip, ec);
+                images.insert(images.end(), found.begin(), found.end());
+            } else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO) && isImage(path))
+                images.emplace_back(path, ec);
+        }
+        // An image written twice, or also found by a rescan, is only processed once
+        std::sort(images.begin(), images.end());
+        images.erase(std::unique(images.begin(), images.end()), images.end());
+        return images;
+    }
+
+private:
+    int m_fd;
+    fs::path m_root;
+    fs::path m_skip;
+    std::unordered_map<int, fs::path> m_dirs;
+
+    Watcher(int fd, fs::path const &root, fs::path const &skip)
+            : m_fd(fd)
+            , m_root(root)
+            , m_skip(skip) { }
+
+    // Watches dir and the directories under it
+    bool add(fs::path const &dir) {
+        auto const wd = inotify_add_watch(m_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR);
+        if (wd < 0) {
+            println("Could not watch {}: {}", dir.c_str(), std::strerror(errno));
+            return false;
+        }
+        m_dirs.insert_or_assign(wd, dir);
+
+        std::error_code ec;
+        for (auto const &entry : fs::directory_iterator(dir, fs::directory_options::skip_permission_denied, ec))
+            if (entry.is_directory(ec) && !fs::equivalent(entry.path(), m_skip, ec)) add(entry.path());
+        return true;
+    }
+};
+#endif
+}  // namespace
+
+int processDirectory(Options const &opts, fs::path const &indir, fs::path const &outdir) {
+    // Images which are up to date are skipped, which would leave gaps in the history
+    if (opts.temporal != Temporal::None) {
+        println("Temporal filters need a Y4M stream or shared memory");
+        return 1;
+    }
+    std::error_code ec;
+    fs::create_directories(outdir, ec);
+    if (ec) {
+        println("Could not create directory {}: {}", outdir.c_str(), ec.message());
+        return 1;
+    }
+
+    auto const manifest_path = outdir / manifest_name;
+    auto manifest = readManifest(manifest_path);
+    auto *const log = std::fopen(manifest_path.c_str(), "a");
+    if (!log) {
+        println("Could not open manifest {}", manifest_path.c_str());
+        return 1;
+    }
+    defer {
+        std::fclose(log);
+        compactManifest(manifest_path, indir, manifest);
+    };
+
+    // Filters use every thread on each image in turn. Without one, decoding and encoding are all there is to do, and
+    // each takes a single thread, so images are converted side by side instead, with a Processor for each thread.
+    auto const width = opts.alg == Alg::None && !opts.diff_frames ? converters() : 1;
+    std::vector<Processor> processors;
+    for (size_t i = 0; i < width; i++) {
+        auto processor = Processor::create(opts);
+        if (!processor) return 1;
+        processors.push_back(std::move(*processor));
+    }
+    auto frames = opts.diff_frames ? std::make_optional<IncrementalFilter>() : std::nullopt;
+    auto const options = optionsHash(opts);
+    int processed = 0, skipped = 0, failed = 0;
+    // Declared after everything its callbacks use, so that it is drained first
+    FileIo io(io_depth);
+
+    // Inputs are read ahead and outputs written behind while images are filtered one at a time, or converted width at
+    // a time, in order
+    auto const filter = [&](std::vector<fs::directory_entry> const &inputs) {
+        struct Input {
+            fs::path path;
+            std::string rel;
+            fs::path out;
+            Stamp stamp;
+            std::optional<std::vector<std::uint8_t>> data;
+            bool read;
+            std::vector<std::uint8_t> encoded;
+            int status;
+        };
+        std::vector<Input> todo;
+        // Converting a.bmp and a.tga would both make a.png
+        std::unordered_set<std::string> outputs;
+        for (auto const &input : inputs) {
+            std::error_code ignored;
+            auto rel = input.path().lexically_relative(indir).generic_string();
+            auto out = outdir / rel;
+            if (opts.convert_to) {
+                out.replace_extension(opts.convert_to);
+                if (!outputs.insert(out.string()).second) {
+                    println("Not converting {}, another image was already converted to {}",
+                        input.path().c_str(),
+                        out.c_str());
+                    failed++;
+                    continue;
+                }
+            }
+            auto const mtime = std::int64_t(input.last_write_time(ignored).time_since_epoch().count());
+            Stamp const stamp {options, mtime, input.file_size(ignored)};
+            if (auto const found = manifest.find(rel);
+                found != manifest.end() && found->second == stamp && fs::exists(out, ignored)) {
+                skipped++;
+                continue;
+            }
+            todo.push_back(Input {input.path(), std::move(rel), std::move(out), stamp, std::nullopt, false, {}, 0});
+        }
+
+        size_t next_read = 0;
+        std::uintmax_t ahead = 0;
+        for (size_t i = 0; i < todo.size(); i += width) {
+            auto const end = std::min(todo.size(), i + width);
+            // The inputs about to be processed are always read, however large they are
+            for (; next_read < todo.size() && next_read < end + io_depth - 1
+                   && (next_read < end || ahead + todo[next_read].stamp.size <= read_ahead_bytes);
+                 next_read++) {
+                ahead += todo[next_read].stamp.size;
+                io.read(todo[next_read].path, [&, n = next_read](std::vector<std::uint8_t> data, bool ok) {
+                    if (ok) todo[n].data = std::move(data);
+                    todo[n].read = true;
+                });
+            }
+            for (auto n = i; n < end; n++)
+                while (!todo[n].read)
+                    io.wait();
+
+#pragma omp parallel for schedule(dynamic, 1) num_threads(int(end - i)) if (end - i > 1)
+            for (auto n = i; n < end; n++) {
+                auto &input = todo[n];
+                if (!input.data) continue;
+                auto const type = File::typeFromName(input.out.c_str());
+                input.status = processors[converter()].process(
+                    *input.data, input.path.c_str(), type, input.encoded, frames ? &*frames : nullptr);
+            }
+
+            for (auto n = i; n < end; n++) {
+                auto &input = todo[n];
+                ahead -= input.stamp.size;
+                std::error_code ignored;
+                auto const fail = [&] {
+                    // Do not leave an old output behind, it would look up to date to anything going by mtime
+                    fs::remove(input.out, ignored);
+                    failed++;
+                };
+                if (!input.data) {
+                    println("Could not read image {}", input.path.c_str());
+                    fail();
+                    continue;
+                }
+                input.data.reset();
+                if (input.status) {
+                    fail();
+                    continue;
+                }
+                fs::create_directories(input.out.parent_path(), ignored);
+                io.write(input.out,
+                    std::move(input.encoded),
+                    [&, out = input.out, rel = input.rel, stamp = input.stamp](std::vector<std::uint8_t>, bool ok) {
+                        if (!ok) {
+                            println("Could not write image to {}", out.c_str());
+                            std::error_code ignored;
+                            fs::remove(out, ignored);
+                            failed++;
+                            return;
+                        }
+                        writeEntry(log, rel, stamp);
+                        manifest.insert_or_assign(rel, stamp);
+                        processed++;
+                    });
+            }
+        }
+        io.drain();
+    };
+
+#ifdef __linux__
+    // Watches are set up before the first scan, so that nothing written in between is missed
+    std::optional<Watcher> watcher;
+    if (opts.watch && !(watcher = Watcher::create(indir, outdir))) return 1;
+#endif
+
+    // Filtered in a predictable order, which is what makes up a sequence of frames
+    auto const inputs = findImages(indir, outdir, ec);
+    if (ec) {
+        println("Could not read directory {}: {}", indir.c_str(), ec.message());
+        return 1;
+    }
+    filter(inputs);
+    println("{} processed, {} up to date, {} failed.", processed, skipped, failed);
+
+#ifdef __linux__
+    if (watcher) {
+        println("Watching {} for new images.", indir.c_str());
+        while (auto const changed = watcher->wait())
+            filter(*changed);
+        println("{} processed, {} up to date, {} failed.", processed, skipped, failed);
+    }
+#endif
+    return failed ? 1 : 0;
+}
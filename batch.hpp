@@ -0,0 +1,15 @@
+#ifndef BATCH_HPP
+#define BATCH_HPP
+
+#include "args.hpp"
+
+#include <filesystem>
+
+// Filters every image under indir into the same relative path under outdir. Like make, images are only processed if
+// they or the options changed since their output was made. This is tracked in a manifest in outdir, which records the
+// size and modification time of each input along with a hash of the options. With --convert-to, outputs get that
+// extension instead, and so that format. Without a filter, images are converted side by side, one per thread.
+// Returns the exit status for main.
+int processDirectory(Options const &opts, std::filesystem::path const &indir, std::filesystem::path const &outdir);
+
+#endif  // BATCH_HPP
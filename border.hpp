@@ -0,0 +1,51 @@
+#ifndef BORDER_HPP
+#define BORDER_HPP
+
+#include <sys/types.h>
+
+// How pixels outside of the image are sampled, using "abcdefgh" as an example row:
+//   Reflect     fedcba|abcdefgh|hgfedcb
+//   Reflect101  gfedcb|abcdefgh|gfedcba
+//   Clamp       aaaaaa|abcdefgh|hhhhhhh
+//   Wrap        cdefgh|abcdefgh|abcdefg
+//   Constant    000000|abcdefgh|0000000
+enum struct Border { Reflect, Reflect101, Clamp, Wrap, Constant };
+
+// Maps coordinate x onto [0, n) according to the border mode B. Returns -1 if the coordinate is outside of the image
+// and B is Border::Constant, i.e. the tap should be skipped.
+template<Border B>
+inline constexpr ssize_t borderIndex(ssize_t x, ssize_t n) noexcept {
+    if (x >= 0 && x < n) return x;
+    if constexpr (B == Border::Constant) {
+        return -1;
+    } else if constexpr (B == Border::Clamp) {
+        return x < 0 ? 0 : n - 1;
+    } else if constexpr (B == Border::Wrap) {
+        x %= n;
+        return x < 0 ? x + n : x;
+    } else if constexpr (B == Border::Reflect) {
+        auto const period = 2 * n;
+        x %= period;
+        if (x < 0) x += period;
+        return x < n ? x : period - 1 - x;
+    } else {
+        if (n == 1) return 0;
+        auto const period = 2 * (n - 1);
+        x %= period;
+        if (x < 0) x += period;
+        return x < n ? x : period - x;
+    }
+}
+
+inline constexpr char const *borderName(Border border) noexcept {
+    switch (border) {
+        case Border::Reflect: return "reflect";
+        case Border::Reflect101: return "reflect101";
+        case Border::Clamp: return "clamp";
+        case Border::Wrap: return "wrap";
+        case Border::Constant: return "constant";
+    }
+    return "unknown";
+}
+
+#endif  // BORDER_HPP
@@ -0,0 +1,114 @@
+#include "cache.hpp"
+
+#define PRINT_FILE stderr
+#include "print.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <thread>
+
+#ifdef __unix__
+#    include <sys/stat.h>
+#    include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+namespace diskcache {
+// Bump when the layout of any entry, or the code generator, changes
+static constexpr std::uint32_t format_version = 3;
+static fs::path cache_dir;
+
+static std::string const &cpuModel() noexcept {
+    static std::string const model = [] {
+        std::ifstream cpuinfo("/proc/cpuinfo");
+        std::string line;
+        while (std::getline(cpuinfo, line))
+            if (line.starts_with("model name")) return line;
+        return std::string("unknown");
+    }();
+    return model;
+}
+
+static fs::path entryPath(std::string_view kind, std::uint64_t key) {
+    return cache_dir / std::format("{}-{:016x}", kind, key);
+}
+
+void enable(char const *dir) noexcept {
+    std::error_code ec;
+    if (fs::create_directories(dir, ec))
+        fs::permissions(dir, fs::perms::group_write | fs::perms::others_write, fs::perm_options::remove, ec);
+    if (ec || !fs::is_directory(dir, ec)) {
+        println("Could not use cache directory {}: {}", dir, ec ? ec.message() : "not a directory");
+        return;
+    }
+    // Generated code is run straight from the cache, so nobody else may be able to put anything in it
+    auto const perms = fs::status(dir, ec).permissions();
+    if (ec || (perms & (fs::perms::group_write | fs::perms::others_write)) != fs::perms::none) {
+        println("Not using cache directory {}: it is writable by other users", dir);
+        return;
+    }
+#ifdef __unix__
+    if (struct stat st; stat(dir, &st) || st.st_uid != geteuid()) {
+        println("Not using cache directory {}: it is owned by another user", dir);
+        return;
+    }
+#endif
+    cache_dir = dir;
+}
+
+bool enabled() noexcept {
+    return !cache_dir.empty();
+}
+
+Hasher key(std::string_view kind) noexcept {
+    return Hasher {}.add(format_version).add(kind).add(std::string_view(cpuModel()));
+}
+
+std::optional<std::vector<std::uint8_t>> load(std::string_view kind, std::uint64_t key) noexcept {
+    if (!enabled()) return std::nullopt;
+    auto *const fp = std::fopen(entryPath(kind, key).c_str(), "rb");
+    if (!fp) return std::nullopt;
+    std::vector<std::uint8_t> data;
+    std::uint8_t buf[4096];
+    for (size_t n; (n = std::fread(buf, 1, sizeof(buf), fp));)
+        data.insert(data.end(), buf, buf + n);
+    auto const failed = std::ferror(fp);
+    std::fclose(fp);
+
+    // Entries end with a checksum, anything that does not match is treated as a miss and overwritten later
+    std::uint64_t sum;
+    if (failed || data.size() < sizeof(sum)) return std::nullopt;
+    auto const size = data.size() - sizeof(sum);
+    std::memcpy(&sum, data.data() + size, sizeof(sum));
+    if (sum != Hasher {}.add(key).add(data.data(), size).state) return std::nullopt;
+    data.resize(size);
+    return data;
+}
+
+void store(std::string_view kind, std::uint64_t key, void const *data, size_t size) noexcept {
+    if (!enabled()) return;
+    auto const path = entryPath(kind, key);
+    auto tmp = path;
+    // Jobs in one process can store the same key at the same time, so the name has to be unique to the thread
+#ifdef __unix__
+    tmp += std::format(".tmp{}-{}", getpid(), std::hash<std::thread::id> {}(std::this_thread::get_id()));
+#else
+    tmp += std::format(".tmp{}", std::hash<std::thread::id> {}(std::this_thread::get_id()));
+#endif
+    auto *const fp = std::fopen(tmp.c_str(), "wb");
+    if (!fp) return;
+    auto const sum = Hasher {}.add(key).add(data, size).state;
+    auto const written = std::fwrite(data, 1, size, fp) == size && std::fwrite(&sum, sizeof(sum), 1, fp) == 1;
+    std::error_code ec;
+    if (std::fclose(fp) || !written) {
+        fs::remove(tmp, ec);
+        return;
+    }
+    fs::rename(tmp, path, ec);
+    if (ec) fs::remove(tmp, ec);
+}
+}  // namespace diskcache
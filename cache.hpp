@@ -0,0 +1,37 @@
+#ifndef CACHE_HPP
+#define CACHE_HPP
+
+#include "hash.hpp"
+
+#include <cstdint>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+// On disk cache for things which are expensive to prepare and only depend on their parameters and the machine, such as
+// kernel decompositions, generated code and planner decisions. Entries are stored as one file per key in the cache
+// directory and are shared between invocations.
+//
+// Disabled unless enable() was called, in which case load() always misses and store() does nothing.
+//
+// The cache directory is trusted: generated code loaded from it is mapped executable, and the checksums only catch
+// damage, not tampering. Anyone who can write to the directory can run code as the user of the cache. For that reason
+// directories which other users can write to are refused.
+namespace diskcache {
+// Creates dir if needed, writable only by its owner. Prints a warning and leaves the cache disabled if the directory
+// cannot be used, or if it is owned by another user or writable by the group or others.
+void enable(char const *dir) noexcept;
+
+bool enabled() noexcept;
+
+// Starts a key for an entry of the given kind, which already includes the CPU model and the cache format version
+Hasher key(std::string_view kind) noexcept;
+
+std::optional<std::vector<std::uint8_t>> load(std::string_view kind, std::uint64_t key) noexcept;
+
+// Written to a temporary file and renamed into place, so concurrent readers never see a partial entry. Entries carry a
+// checksum, load() misses on anything damaged.
+void store(std::string_view kind, std::uint64_t key, void const *data, size_t size) noexcept;
+}  // namespace diskcache
+
+#endif  // CACHE_HPP
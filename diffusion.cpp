@@ -0,0 +1,97 @@
+#include "diffusion.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace {
+// One diffusion step for a row, up and down are the neighbouring rows, or mid at the top and bottom of the image
+void diffuseRow(float const up[],
+    float const mid[],
+    float const down[],
+    float out[],
+    ssize_t width,
+    int channels,
+    float inv_kappa_2,
+    float lambda) noexcept {
+    auto const flux = [inv_kappa_2](float d) { return d / (1.f + d * d * inv_kappa_2); };
+
+    auto const edgePixel = [&](ssize_t x) {
+        for (int ch = 0; ch < channels; ch++) {
+            auto const b = x * channels + ch;
+            auto const c = mid[b];
+            auto sum = flux(up[b] - c) + flux(down[b] - c);
+            if (x > 0) sum += flux(mid[b - channels] - c);
+            if (x < width - 1) sum += flux(mid[b + channels] - c);
+            out[b] = c + lambda * sum;
+        }
+    };
+
+    edgePixel(0);
+#pragma omp simd
+    for (ssize_t b = channels; b < (width - 1) * channels; b++) {
+        auto const c = mid[b];
+        auto const sum
+            = flux(up[b] - c) + flux(down[b] - c) + flux(mid[b - channels] - c) + flux(mid[b + channels] - c);
+        out[b] = c + lambda * sum;
+    }
+    if (width > 1) edgePixel(width - 1);
+}
+}  // namespace
+
+void diffuse(Image const &image,
+    int iterations,
+    double kappa,
+    double lambda,
+    std::uint8_t const lut[256],
+    std::uint8_t out[]) {
+    auto const height = ssize_t(image.height);
+    auto const width = ssize_t(image.width);
+    auto const row_len = width * image.channels;
+    // Bands are the only work shared out between threads
+    auto const band_rows = bandRows(row_len * ssize_t(sizeof(float)), iterations, height, maxThreads());
+    auto const nbands = (height + band_rows - 1) / band_rows;
+    auto const scratch_len = size_t((band_rows + 2 * iterations) * row_len);
+    auto const inv_kappa_2 = float(1. / (kappa * kappa));
+
+#pragma omp parallel
+    {
+        std::vector<float> scratch[2] {
+            std::vector<float>(scratch_len),
+            std::vector<float>(scratch_len),
+        };
+
+#pragma omp for schedule(dynamic)
+        for (ssize_t band = 0; band < nbands; band++) {
+            auto const y0 = band * band_rows;
+            auto const y1 = std::min(height, y0 + band_rows);
+
+            // The band and its halo are the only part of the image that is read
+            auto lo = std::max(ssize_t(0), y0 - iterations);
+            auto hi = std::min(height, y1 + iterations);
+            std::copy(image.data + lo * row_len, image.data + hi * row_len, scratch[0].data());
+
+            for (int k = 1; k <= iterations; k++) {
+                auto const *const src = scratch[(k - 1) % 2].data();
+                auto *const dst = scratch[k % 2].data();
+                auto const next_lo = std::max(ssize_t(0), y0 - (iterations - k));
+                auto const next_hi = std::min(height, y1 + (iterations - k));
+                for (ssize_t y = next_lo; y < next_hi; y++) {
+                    auto const *const mid = src + (y - lo) * row_len;
+                    auto const *const up = y > 0 ? mid - row_len : mid;
+                    auto const *const down = y < height - 1 ? mid + row_len : mid;
+                    auto *const row = dst + (y - next_lo) * row_len;
+                    diffuseRow(up, mid, down, row, width, image.channels, inv_kappa_2, float(lambda));
+                }
+                lo = next_lo;
+                hi = next_hi;
+            }
+
+            auto const *const result = scratch[iterations % 2].data();
+            for (ssize_t b = 0; b < (y1 - y0) * row_len; b++) {
+                auto const px = std::uint8_t(std::clamp(std::lround(result[b]), 0l, 255l));
+                out[y0 * row_len + b] = lut ? lut[px] : px;
+            }
+        }
+    }
+}
@@ -0,0 +1,22 @@
+#ifndef DIFFUSION_HPP
+#define DIFFUSION_HPP
+
+#include "filter.hpp"
+
+#include <cstdint>
+
+// Perona-Malik anisotropic diffusion using the conduction function g(d) = 1 / (1 + (d / kappa)^2), with a zero flux
+// boundary. Each iteration moves every pixel by lambda times the conduction weighted sum of the differences to its 4
+// neighbours, lambda has to be at most 0.25 for the result to be stable.
+//
+// Iterations are run over bands of rows which stay in cache, in the same way as applyPass. Each band is loaded once
+// with a halo of one row per iteration and then diffused in place between two float buffers, and is only rounded
+// back to bytes (and mapped through lut) after the last iteration.
+void diffuse(Image const &image,
+    int iterations,
+    double kappa,
+    double lambda,
+    std::uint8_t const lut[256],
+    std::uint8_t out[]);
+
+#endif  // DIFFUSION_HPP
@@ -0,0 +1,239 @@
+#include "fileio.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#    include <atomic>
+#    include <linux/io_uring.h>
+#    include <sys/mman.h>
+#    include <sys/syscall.h>
+
+namespace {
+// io_uring_enter(2). Built with FILEIO_FAULTS, every other submission fails as if the kernel was short of resources,
+// so that falling back to blocking calls can be tried out.
+long enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) noexcept {
+#    ifdef FILEIO_FAULTS
+    static std::atomic<unsigned> calls = 0;
+    if (to_submit && calls++ % 2) {
+        errno = EAGAIN;
+        return -1;
+    }
+#    endif
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+}  // namespace
+#endif
+
+FileIo::FileIo(unsigned depth)
+        : m_depth(std::max(depth, 1u)) {
+#ifdef __linux__
+    io_uring_params params {};
+    auto const fd = int(syscall(__NR_io_uring_setup, m_depth, &params));
+    // Not available, e.g. an old kernel or a container which does not allow it
+    if (fd < 0) return;
+
+    m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(std::uint32_t);
+    m_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    auto const single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single) m_sq_ring_size = m_cq_ring_size = std::max(m_sq_ring_size, m_cq_ring_size);
+    m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    auto const map = [&](size_t size, off_t offset) {
+        return mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    };
+    m_sq_ring = map(m_sq_ring_size, IORING_OFF_SQ_RING);
+    m_cq_ring = single || m_sq_ring == MAP_FAILED ? m_sq_ring : map(m_cq_ring_size, IORING_OFF_CQ_RING);
+    m_sqes = m_cq_ring == MAP_FAILED ? MAP_FAILED : map(m_sqes_size, IORING_OFF_SQES);
+    if (m_sqes == MAP_FAILED) {
+        if (m_cq_ring != MAP_FAILED && m_cq_ring != m_sq_ring) munmap(m_cq_ring, m_cq_ring_size);
+        if (m_sq_ring != MAP_FAILED) munmap(m_sq_ring, m_sq_ring_size);
+        m_sq_ring = m_cq_ring = m_sqes = nullptr;
+        close(fd);
+        return;
+    }
+
+    auto *const sq = static_cast<char *>(m_sq_ring);
+    auto *const cq = static_cast<char *>(m_cq_ring);
+    m_sq_tail = reinterpret_cast<std::uint32_t *>(sq + params.sq_off.tail);
+    m_sq_mask = reinterpret_cast<std::uint32_t *>(sq + params.sq_off.ring_mask);
+    m_sq_array = reinterpret_cast<std::uint32_t *>(sq + params.sq_off.array);
+    m_cq_head = reinterpret_cast<std::uint32_t *>(cq + params.cq_off.head);
+    m_cq_tail = reinterpret_cast<std::uint32_t *>(cq + params.cq_off.tail);
+    m_cq_mask = reinterpret_cast<std::uint32_t *>(cq + params.cq_off.ring_mask);
+    m_cqes = cq + params.cq_off.cqes;
+    m_ring_fd = fd;
+#endif
+}
+
+FileIo::~FileIo() noexcept {
+    // The kernel may still be using the buffers
+    drain();
+    closeRing();
+}
+
+void FileIo::closeRing() noexcept {
+#ifdef __linux__
+    if (m_ring_fd < 0) return;
+    munmap(m_sqes, m_sqes_size);
+    if (m_cq_ring != m_sq_ring) munmap(m_cq_ring, m_cq_ring_size);
+    munmap(m_sq_ring, m_sq_ring_size);
+    close(m_ring_fd);
+    m_ring_fd = -1;
+#endif
+}
+
+void FileIo::read(std::string const &path, Done done) {
+    auto const fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    auto const id = m_next_id++;
+    auto &op = m_ops.emplace(id, Op {fd, false, {}, 0, std::move(done)}).first->second;
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        m_ready.emplace_back(id, false);
+        return;
+    }
+    op.data.resize(size_t(st.st_size));
+    start(id, op);
+}
+
+void FileIo::write(std::string const &path, std::vector<std::uint8_t> data, Done done) {
+    auto const fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    auto const id = m_next_id++;
+    auto &op = m_ops.emplace(id, Op {fd, true, std::move(data), 0, std::move(done)}).first->second;
+    if (fd < 0) {
+        m_ready.emplace_back(id, false);
+        return;
+    }
+    start(id, op);
+}
+
+bool FileIo::wait() {
+    if (!m_ready.empty()) {
+        auto const [id, ok] = m_ready.back();
+        m_ready.pop_back();
+        finish(id, ok);
+        return true;
+    }
+#ifdef __linux__
+    if (!m_in_flight) return false;
+    auto const head = *m_cq_head;
+    while (std::atomic_ref(*m_cq_tail).load(std::memory_order_acquire) == head) {
+        // EBUSY means completions are waiting to be reaped, which the loop does
+        if (enter(m_ring_fd, 0, 1, IORING_ENTER_GETEVENTS) >= 0 || errno == EINTR || errno == EAGAIN || errno == EBUSY)
+            continue;
+        abandonRing();
+        return true;
+    }
+    auto const &cqe = static_cast<io_uring_cqe const *>(m_cqes)[head & *m_cq_mask];
+    auto const id = cqe.user_data;
+    auto const res = cqe.res;
+    std::atomic_ref(*m_cq_head).store(head + 1, std::memory_order_release);
+    m_in_flight--;
+
+    auto &op = m_ops.at(id);
+    op.in_ring = false;
+    if (res == -EINTR || res == -EAGAIN) {
+        submit(id, op);
+        return true;
+    }
+    if (res < 0 || (res == 0 && op.write)) {
+        finish(id, false);
+        return true;
+    }
+    op.done += size_t(res);
+    // The file got shorter while it was read
+    if (res == 0) op.data.resize(op.done);
+    if (op.done < op.data.size())
+        submit(id, op);
+    else
+        finish(id, true);
+    return true;
+#else
+    return false;
+#endif
+}
+
+void FileIo::drain() {
+    while (wait()) { }
+}
+
+void FileIo::start(std::uint64_t id, Op &op) {
+    if (op.data.empty()) {
+        m_ready.emplace_back(id, true);
+        return;
+    }
+    if (m_ring_fd >= 0) return submit(id, op);
+    transfer(id, op);
+}
+
+void FileIo::transfer(std::uint64_t id, Op &op) {
+    while (op.done < op.data.size()) {
+        auto *const at = op.data.data() + op.done;
+        auto const left = op.data.size() - op.done;
+        auto const n = op.write ? pwrite(op.fd, at, left, off_t(op.done)) : pread(op.fd, at, left, off_t(op.done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 || (n == 0 && op.write)) {
+            m_ready.emplace_back(id, false);
+            return;
+        }
+        if (n == 0) op.data.resize(op.done);
+        op.done += size_t(n);
+    }
+    m_ready.emplace_back(id, true);
+}
+
+void FileIo::submit([[maybe_unused]] std::uint64_t id, [[maybe_unused]] Op &op) {
+#ifdef __linux__
+    // Makes room by reporting whatever finishes first
+    while (m_in_flight >= m_depth)
+        wait();
+    if (m_ring_fd < 0) return transfer(id, op);
+    auto const tail = *m_sq_tail;
+    auto const index = tail & *m_sq_mask;
+    auto &sqe = static_cast<io_uring_sqe *>(m_sqes)[index];
+    std::memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = op.write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe.fd = op.fd;
+    sqe.off = op.done;
+    sqe.addr = reinterpret_cast<std::uintptr_t>(op.data.data() + op.done);
+    // Transfers are limited to what fits into a signed int
+    sqe.len = std::uint32_t(std::min(op.data.size() - op.done, size_t(1) << 30));
+    sqe.user_data = id;
+    m_sq_array[index] = index;
+    std::atomic_ref(*m_sq_tail).store(tail + 1, std::memory_order_release);
+
+    long submitted;
+    while ((submitted = enter(m_ring_fd, 1, 0, 0)) < 0 && errno == EINTR) { }
+    if (submitted == 1) {
+        op.in_ring = true;
+        m_in_flight++;
+        return;
+    }
+    // The kernel did not take the entry, e.g. for lack of memory. It is taken back, so that it cannot be submitted
+    // along with a later one, and the rest of the operation is done with blocking calls instead.
+    std::atomic_ref(*m_sq_tail).store(tail, std::memory_order_release);
+    transfer(id, op);
+#endif
+}
+
+void FileIo::abandonRing() {
+    // Operations still in the ring are failed, but their buffers are kept as the kernel may yet write to them
+    for (auto &[id, op] : m_ops)
+        if (op.in_ring) {
+            op.in_ring = false;
+            m_abandoned.push_back(std::move(op.data));
+            m_ready.emplace_back(id, false);
+        }
+    m_in_flight = 0;
+    closeRing();
+}
+
+void FileIo::finish(std::uint64_t id, bool ok) {
+    auto node = m_ops.extract(id);
+    auto &op = node.mapped();
+    if (op.fd >= 0 && close(op.fd) < 0 && op.write) ok = false;
+    op.callback(std::move(op.data), ok);
+}
@@ -0,0 +1,83 @@
+#ifndef FILEIO_HPP
+#define FILEIO_HPP
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Reads and writes whole files with up to depth of them in flight at once, so that slow storage does not leave the
+// filter waiting. Uses io_uring where the kernel allows it, and plain blocking calls otherwise (or off Linux), in
+// which case every operation is done by the time it is started.
+//
+// Files are opened and closed with blocking calls, only the data goes through the ring. Completions are reported
+// from wait() or drain(), on the thread calling it. An operation the kernel refuses to take into the ring is finished
+// with blocking calls, and if the ring cannot be waited on, the operations in it fail and blocking calls are used from
+// then on.
+class FileIo {
+public:
+    // Called with the data read or written, and whether the operation succeeded
+    using Done = std::function<void(std::vector<std::uint8_t> data, bool ok)>;
+
+    explicit FileIo(unsigned depth);
+    ~FileIo() noexcept;
+    FileIo(FileIo const &) = delete;
+    FileIo &operator=(FileIo const &) = delete;
+
+    // Starts reading the whole of path
+    void read(std::string const &path, Done done);
+    // Starts replacing the contents of path with data
+    void write(std::string const &path, std::vector<std::uint8_t> data, Done done);
+
+    // Blocks until an operation completes and reports it. Returns false if there was nothing left to wait for.
+    bool wait();
+    // Waits for everything in flight
+    void drain();
+
+private:
+    struct Op {
+        int fd;
+        bool write;
+        std::vector<std::uint8_t> data;
+        size_t done;
+        Done callback;
+        bool in_ring = false;
+    };
+
+    unsigned m_depth;
+    std::uint64_t m_next_id = 0;
+    std::unordered_map<std::uint64_t, Op> m_ops;
+    // Finished without going through the ring, and whether they succeeded
+    std::vector<std::pair<std::uint64_t, bool>> m_ready;
+
+    // The ring, see io_uring_setup(2). m_ring_fd is -1 if it is not available.
+    int m_ring_fd = -1;
+    void *m_sq_ring = nullptr;
+    void *m_cq_ring = nullptr;
+    size_t m_sq_ring_size = 0;
+    size_t m_cq_ring_size = 0;
+    void *m_sqes = nullptr;
+    size_t m_sqes_size = 0;
+    std::uint32_t *m_sq_tail = nullptr;
+    std::uint32_t *m_sq_mask = nullptr;
+    std::uint32_t *m_sq_array = nullptr;
+    std::uint32_t *m_cq_head = nullptr;
+    std::uint32_t *m_cq_tail = nullptr;
+    std::uint32_t *m_cq_mask = nullptr;
+    void *m_cqes = nullptr;
+    unsigned m_in_flight = 0;
+    // Buffers of operations given up on while in the ring
+    std::vector<std::vector<std::uint8_t>> m_abandoned;
+
+    void start(std::uint64_t id, Op &op);
+    void submit(std::uint64_t id, Op &op);
+    // Does the rest of op with blocking calls
+    void transfer(std::uint64_t id, Op &op);
+    void finish(std::uint64_t id, bool ok);
+    void abandonRing();
+    void closeRing() noexcept;
+};
+
+#endif  // FILEIO_HPP
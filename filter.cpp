@@ -0,0 +1,544 @@
+#include "filter.hpp"
+
+#include "cache.hpp"
+#include "jit.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <iterator>
+#include <limits>
+#include <unistd.h>
+#include <utility>
+
+#ifdef _OPENMP
+#    include <omp.h>
+#endif
+
+namespace {
+template<Border B>
+void fillTable(std::vector<ssize_t> &table, ssize_t size, int halo, ssize_t step) {
+    table.resize(size_t(size + 2 * halo));
+    for (ssize_t i = -halo; i < size + halo; i++) {
+        auto const idx = borderIndex<B>(i, size);
+        table[size_t(i + halo)] = idx < 0 ? -1 : idx * step;
+    }
+}
+
+template<Border B>
+BorderTables makeBorderTablesImpl(Image const &image, int halo) {
+    BorderTables tables {halo, -halo, {}, {}};
+    fillTable<B>(tables.rows, image.height, halo, ssize_t(image.width) * image.channels);
+    fillTable<B>(tables.cols, image.width, halo, image.channels);
+    return tables;
+}
+}  // namespace
+
+BorderTables makeBorderTables(Image const &image, Border border, int halo) {
+    switch (border) {
+        case Border::Reflect: return makeBorderTablesImpl<Border::Reflect>(image, halo);
+        case Border::Reflect101: return makeBorderTablesImpl<Border::Reflect101>(image, halo);
+        case Border::Clamp: return makeBorderTablesImpl<Border::Clamp>(image, halo);
+        case Border::Wrap: return makeBorderTablesImpl<Border::Wrap>(image, halo);
+        case Border::Constant: return makeBorderTablesImpl<Border::Constant>(image, halo);
+    }
+    return {};
+}
+
+BorderTables sliceTables(BorderTables const &tables, ssize_t begin, ssize_t end, ssize_t first, ssize_t row_len) {
+    BorderTables slice {tables.halo, begin, std::vector<ssize_t>(size_t(end - begin)), tables.cols};
+    for (ssize_t y = begin; y < end; y++) {
+        auto const offset = tables.row(y);
+        assert(offset < 0 || offset >= first * row_len);
+        slice.rows[size_t(y - begin)] = offset < 0 ? -1 : offset - first * row_len;
+    }
+    return slice;
+}
+
+Kernel makeKernel(double const mat[], int matsize) {
+    auto const size_2 = size_t(matsize * matsize);
+    Kernel kernel {matsize, std::vector<double>(mat, mat + size_2), false, {}, {}};
+
+    // A rank 1 matrix is the outer product of any of its non-zero columns and the matching row
+    auto const pivot = size_t(std::max_element(mat, mat + size_2, [](double a, double b) {
+        return std::abs(a) < std::abs(b);
+    }) - mat);
+    auto const max = std::abs(mat[pivot]);
+    if (max == 0.) return kernel;
+    auto const px = int(pivot) / matsize;
+    auto const py = int(pivot) % matsize;
+    auto xs = std::vector<double>(size_t(matsize));
+    auto ys = std::vector<double>(size_t(matsize));
+    for (int i = 0; i < matsize; i++) {
+        xs[size_t(i)] = mat[i * matsize + py] / mat[pivot];
+        ys[size_t(i)] = mat[px * matsize + i];
+    }
+    for (int x = 0; x < matsize; x++)
+        for (int y = 0; y < matsize; y++)
+            if (std::abs(xs[size_t(x)] * ys[size_t(y)] - mat[x * matsize + y]) > max * 1e-9) return kernel;
+
+    kernel.separable = true;
+    kernel.xs = std::move(xs);
+    kernel.ys = std::move(ys);
+    return kernel;
+}
+
+namespace {
+JitRowFn rowFunction(Kernel const &kernel, int channels) {
+    if (kernel.separable) return nullptr;
+    if (kernel.fixed) return kernel.fixed(channels);
+    return kernel.jit ? jitCompile(kernel, channels) : nullptr;
+}
+
+// Horizontal pass over the interior of a row with the number of taps and channels known at compile time. Taps are
+// summed in the same order as the generic loop, so both give the same result.
+template<int N, int C>
+void fixedHorizontal(std::uint8_t const src[], double const xs[], double out[], ssize_t begin, ssize_t end) noexcept {
+#pragma omp simd
+    for (ssize_t b = begin; b < end; b++) {
+        auto sum = 0.;
+        [&]<int... I>(std::integer_sequence<int, I...>) {
+            ((sum += src[b + (I - N / 2) * C] * xs[I]), ...);
+        }(std::make_integer_sequence<int, N> {});
+        out[b] = sum;
+    }
+}
+
+template<int N>
+HorizontalFn fixedHorizontalFor(int channels) {
+    switch (channels) {
+        case 1: return fixedHorizontal<N, 1>;
+        case 2: return fixedHorizontal<N, 2>;
+        case 3: return fixedHorizontal<N, 3>;
+        case 4: return fixedHorizontal<N, 4>;
+    }
+    return nullptr;
+}
+
+// Sizes of the built-in kernels, and the usual sizes of blurs, whose default is 5
+HorizontalFn horizontalFunction(Kernel const &kernel, int channels) {
+    if (!kernel.separable) return nullptr;
+    switch (kernel.size) {
+        case 3: return fixedHorizontalFor<3>(channels);
+        case 5: return fixedHorizontalFor<5>(channels);
+        case 7: return fixedHorizontalFor<7>(channels);
+    }
+    return nullptr;
+}
+
+// Vertical pass over count filtered rows in one sweep, instead of accumulating into out once per row
+template<int K>
+void weightedSum(double const *const rows[], double const ws[], double out[], ssize_t len) noexcept {
+#pragma omp simd
+    for (ssize_t b = 0; b < len; b++) {
+        auto sum = 0.;
+        [&]<int... J>(std::integer_sequence<int, J...>) {
+            ((sum += rows[J][b] * ws[J]), ...);
+        }(std::make_integer_sequence<int, K> {});
+        out[b] = sum;
+    }
+}
+
+using WeightedSumFn = void (*)(double const *const rows[], double const ws[], double out[], ssize_t len);
+
+constexpr WeightedSumFn weighted_sums[] = {
+    nullptr,
+    weightedSum<1>,
+    weightedSum<2>,
+    weightedSum<3>,
+    weightedSum<4>,
+    weightedSum<5>,
+    weightedSum<6>,
+    weightedSum<7>,
+};
+}  // namespace
+
+RowConvolver::RowConvolver(Kernel const &kernel, Image const &image, BorderTables const &tables)
+        : m_kernel(kernel)
+        , m_image(&image)
+        , m_tables(&tables)
+        , m_ring(kernel.separable ? size_t(kernel.size) * size_t(image.width * image.channels) : 0)
+        , m_ring_rows(kernel.separable ? size_t(kernel.size) : 0, std::numeric_limits<ssize_t>::min())
+        , m_row_fn(rowFunction(kernel, image.channels))
+        , m_fn_rows(m_row_fn ? size_t(kernel.size) : 0)
+        , m_horizontal_fn(horizontalFunction(kernel, image.channels))
+        , m_sum_rows(kernel.separable ? size_t(kernel.size) : 0)
+        , m_sum_weights(kernel.separable ? size_t(kernel.size) : 0) {
+    assert(tables.halo >= kernel.size / 2);
+}
+
+void RowConvolver::retarget(Image const &image, BorderTables const &tables) noexcept {
+    assert(image.width == m_image->width && image.channels == m_image->channels);
+    m_image = &image;
+    m_tables = &tables;
+    std::fill(m_ring_rows.begin(), m_ring_rows.end(), std::numeric_limits<ssize_t>::min());
+}
+
+void RowConvolver::row(ssize_t y, double out[]) noexcept {
+    if (m_kernel.separable)
+        separableRow(y, out);
+    else
+        directRow(y, out);
+}
+
+// Returns row y of the image filtered with the horizontal factor of the kernel, or nullptr if the row is outside of
+// the image and the border is constant.
+double const *RowConvolver::filteredRow(ssize_t y) noexcept {
+    auto const offset = m_tables->row(y);
+    if (offset < 0) return nullptr;
+
+    auto const size = m_kernel.size;
+    auto const halfmat = size / 2;
+    auto const channels = m_image->channels;
+    auto const width = ssize_t(m_image->width);
+    auto const row_len = size_t(width * channels);
+    auto const slot = size_t(((y % size) + size) % size);
+    auto *const out = m_ring.data() + slot * row_len;
+    if (m_ring_rows[slot] == y) return out;
+    m_ring_rows[slot] = y;
+
+    auto const *const src = m_image->data + offset;
+    auto const *const xs = m_kernel.xs.data();
+    auto const left = std::min(width, ssize_t(halfmat));
+    auto const right = std::max(left, width - halfmat);
+
+    auto const edgePixel = [&](ssize_t x) {
+        for (int ch = 0; ch < channels; ch++) {
+            auto sum = 0.;
+            for (int i = -halfmat, imat = 0; i <= halfmat; i++, imat++)
+                if (auto const col = m_tables->col(x + i); col >= 0) sum += src[col + ch] * xs[imat];
+            out[x * channels + ch] = sum;
+        }
+    };
+
+    for (ssize_t x = 0; x < left; x++)
+        edgePixel(x);
+    if (m_horizontal_fn) {
+        m_horizontal_fn(src, xs, out, left * channels, right * channels);
+    } else {
+#pragma omp simd
+        for (ssize_t b = left * channels; b < right * channels; b++) {
+            auto sum = 0.;
+            for (int i = -halfmat, imat = 0; i <= halfmat; i++, imat++)
+                sum += src[b + i * channels] * xs[imat];
+            out[b] = sum;
+        }
+    }
+    for (ssize_t x = right; x < width; x++)
+        edgePixel(x);
+    return out;
+}
+
+void RowConvolver::separableRow(ssize_t y, double out[]) noexcept {
+    auto const halfmat = m_kernel.size / 2;
+    auto const row_len = ssize_t(m_image->width * m_image->channels);
+
+    // Only rows that contribute are summed, in order, which rounds the same as accumulating them one by one
+    size_t count = 0;
+    for (int j = -halfmat, jmat = 0; j <= halfmat; j++, jmat++) {
+        auto const *const src = filteredRow(y + j);
+        auto const w = m_kernel.ys[size_t(jmat)];
+        if (!src || w == 0.) continue;
+        m_sum_rows[count] = src;
+        m_sum_weights[count] = w;
+        count++;
+    }
+
+    if (count == 0) {
+        std::fill(out, out + row_len, 0.);
+    } else if (count < std::size(weighted_sums)) {
+        weighted_sums[count](m_sum_rows.data(), m_sum_weights.data(), out, row_len);
+    } else {
+        std::fill(out, out + row_len, 0.);
+        for (size_t j = 0; j < count; j++) {
+            auto const *const src = m_sum_rows[j];
+            auto const w = m_sum_weights[j];
+#pragma omp simd
+            for (ssize_t b = 0; b < row_len; b++)
+                out[b] += src[b] * w;
+        }
+    }
+}
+
+void RowConvolver::directRow(ssize_t y, double out[]) noexcept {
+    auto const size = m_kernel.size;
+    auto const halfmat = size / 2;
+    auto const channels = m_image->channels;
+    auto const width = ssize_t(m_image->width);
+    auto const *const mat = m_kernel.mat.data();
+    auto const left = std::min(width, ssize_t(halfmat));
+    auto const right = std::max(left, width - halfmat);
+
+    std::fill(out, out + width * channels, 0.);
+
+    // Specialised code takes over the interior when every row of the kernel is inside the image, leaving a short tail
+    auto interior = left * channels;
+    if (m_row_fn) {
+        auto complete = true;
+        for (int j = -halfmat, jmat = 0; j <= halfmat; j++, jmat++) {
+            auto const offset = m_tables->row(y + j);
+            complete = complete && offset >= 0;
+            m_fn_rows[size_t(jmat)] = m_image->data + offset + interior;
+        }
+        if (complete) {
+            auto const count = ((right - left) * channels) & ~ssize_t(7);
+            m_row_fn(m_fn_rows.data(), out + interior, size_t(count));
+            interior += count;
+        }
+    }
+
+    for (int j = -halfmat, jmat = 0; j <= halfmat; j++, jmat++) {
+        auto const offset = m_tables->row(y + j);
+        if (offset < 0) continue;
+        auto const *const src = m_image->data + offset;
+
+        for (int i = -halfmat, imat = 0; i <= halfmat; i++, imat++) {
+            auto const w = mat[imat * size + jmat];
+            if (w == 0.) continue;
+
+            // Border columns go through the tables, one lookup per pixel and tap
+            for (ssize_t x = 0; x < left; x++)
+                if (auto const col = m_tables->col(x + i); col >= 0)
+                    for (int ch = 0; ch < channels; ch++)
+                        out[x * channels + ch] += src[col + ch] * w;
+            for (ssize_t x = right; x < width; x++)
+                if (auto const col = m_tables->col(x + i); col >= 0)
+                    for (int ch = 0; ch < channels; ch++)
+                        out[x * channels + ch] += src[col + ch] * w;
+
+            // Every tap of the interior is inside the row, no border logic needed
+            auto const shift = i * channels;
+#pragma omp simd
+            for (ssize_t b = interior; b < right * channels; b++)
+                out[b] += src[b + shift] * w;
+        }
+    }
+}
+
+void planKernel(Kernel &kernel, Image const &image, Border border) {
+    if (!diskcache::enabled() || kernel.separable || kernel.fixed || image.height < 2) return;
+    if (!jitCompile(kernel, image.channels)) return;
+
+    // Timings mostly depend on the length of a row, not on its exact width
+    auto const key = diskcache::key("plan")
+                         .add(kernel.mat.data(), kernel.mat.size() * sizeof(double))
+                         .add(image.channels)
+                         .add(std::bit_width(unsigned(image.width)))
+                         .state;
+    if (auto const entry = diskcache::load("plan", key); entry && entry->size() == 1) {
+        kernel.jit = (*entry)[0];
+        return;
+    }
+
+    auto plain = kernel;
+    plain.jit = false;
+    auto const tables = makeBorderTables(image, border, kernel.size / 2);
+    auto const rows = std::min(ssize_t(image.height), ssize_t(16));
+    auto const y0 = (ssize_t(image.height) - rows) / 2;
+    std::vector<double> out(size_t(image.width * image.channels));
+    // Best of a few runs over rows in the middle of the image, after the first row has filled the ring
+    auto const time = [&](Kernel const &candidate) {
+        auto best = std::chrono::steady_clock::duration::max();
+        RowConvolver conv(candidate, image, tables);
+        for (int run = 0; run < 3; run++) {
+            conv.retarget(image, tables);
+            conv.row(y0, out.data());
+            auto const start = std::chrono::steady_clock::now();
+            for (auto y = y0 + 1; y < y0 + rows; y++)
+                conv.row(y, out.data());
+            best = std::min(best, std::chrono::steady_clock::now() - start);
+        }
+        return best;
+    };
+    std::uint8_t const jit = time(kernel) <= time(plain);
+    diskcache::store("plan", key, &jit, 1);
+    kernel.jit = jit;
+}
+
+size_t cacheSize() noexcept {
+    static constexpr size_t fallback = 1 << 20;
+#ifdef _SC_LEVEL2_CACHE_SIZE
+    auto const size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    return size > 0 ? size_t(size) : fallback;
+#else
+    return fallback;
+#endif
+}
+
+int maxThreads() noexcept {
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+ssize_t bandRows(ssize_t row_bytes, ssize_t halo, ssize_t height, int min_bands) noexcept {
+    // Two scratch buffers per band should fit in cache, but the band should not be much smaller than its halo
+    auto const cache_rows = ssize_t(cacheSize()) / (2 * std::max(row_bytes, ssize_t(1)));
+    auto const rows = std::max(cache_rows - 2 * halo, std::max(2 * halo, ssize_t(16)));
+    auto const bands = std::max(min_bands, 1);
+    auto const shared = (height + bands - 1) / bands;
+    return std::max(std::min({rows, height, shared}), ssize_t(1));
+}
+
+int Pass::halo() const noexcept {
+    return std::max(kernel.size, kernel_y.size) / 2;
+}
+
+namespace {
+// Per-thread state for running a pass one row at a time
+class PassRunner {
+public:
+    PassRunner(Pass const &pass, Image const &image, BorderTables const &tables)
+            : m_pass(pass)
+            , m_image(&image)
+            , m_tables(&tables)
+            , m_conv(pass.kernel, image, tables)
+            , m_conv_y(pass.kernel_y, image, tables)
+            , m_sums(pass.combine == Pass::Combine::Copy ? 0 : size_t(image.width * image.channels))
+            , m_sums_y(pass.combine == Pass::Combine::Magnitude ? m_sums.size() : 0) { }
+
+    void retarget(Image const &image, BorderTables const &tables) noexcept {
+        m_image = &image;
+        m_tables = &tables;
+        m_conv.retarget(image, tables);
+        m_conv_y.retarget(image, tables);
+    }
+
+    void row(ssize_t y, std::uint8_t const lut[256], std::uint8_t out[]) noexcept {
+        auto const row_len = size_t(m_image->width * m_image->channels);
+        switch (m_pass.combine) {
+            case Pass::Combine::Copy: {
+                auto const *const in = m_image->data + m_tables->row(y);
+                std::copy(in, in + row_len, out);
+            } break;
+            case Pass::Combine::Single:
+                m_conv.row(y, m_sums.data());
+                for (size_t b = 0; b < row_len; b++)
+                    out[b] = std::uint8_t(m_sums[b]);
+                break;
+            case Pass::Combine::Magnitude:
+                m_conv.row(y, m_sums.data());
+                m_conv_y.row(y, m_sums_y.data());
+                for (size_t b = 0; b < row_len; b++)
+                    out[b] = std::uint8_t(std::sqrt(m_sums[b] * m_sums[b] + m_sums_y[b] * m_sums_y[b]));
+                break;
+            case Pass::Combine::Absolute:
+                m_conv.row(y, m_sums.data());
+                for (size_t b = 0; b < row_len; b++)
+                    out[b] = std::uint8_t(std::abs(m_sums[b]));
+                break;
+        }
+        if (lut)
+            for (size_t b = 0; b < row_len; b++)
+                out[b] = lut[out[b]];
+    }
+
+private:
+    Pass const &m_pass;
+    Image const *m_image;
+    BorderTables const *m_tables;
+    RowConvolver m_conv;
+    RowConvolver m_conv_y;
+    std::vector<double> m_sums;
+    std::vector<double> m_sums_y;
+};
+
+// Takes every band of rows through all iterations, see applyPass
+void blockedPasses(Pass const &pass,
+    Image const &image,
+    BorderTables const &tables,
+    int iterations,
+    std::uint8_t const lut[256],
+    std::uint8_t out[]) {
+    auto const height = ssize_t(image.height);
+    auto const row_len = ssize_t(image.width) * image.channels;
+    if (iterations == 1) {
+        // Nothing to block, so threads share out rows rather than bands, of which a small image may have only one
+#pragma omp parallel
+        {
+            PassRunner runner(pass, image, tables);
+#pragma omp for
+            for (ssize_t y = 0; y < height; y++)
+                runner.row(y, lut, out + y * row_len);
+        }
+        return;
+    }
+
+    auto const halo = ssize_t(pass.halo());
+    auto const max_ext = (iterations - 1) * halo;
+
+    // Bands are the only work shared out between threads here
+    auto const band_rows = bandRows(row_len, max_ext, height, maxThreads());
+    auto const nbands = (height + band_rows - 1) / band_rows;
+    auto const scratch_len = size_t(iterations > 1 ? (band_rows + 2 * max_ext) * row_len : 0);
+
+#pragma omp parallel
+    {
+        PassRunner runner(pass, image, tables);
+        std::vector<std::uint8_t> scratch[2] {
+            std::vector<std::uint8_t>(scratch_len),
+            std::vector<std::uint8_t>(scratch_len),
+        };
+        Image band_image = image;
+        BorderTables band_tables;
+
+        // Bands at the top and bottom of the image recompute less of their halo, so the amount of work varies
+#pragma omp for schedule(dynamic)
+        for (ssize_t band = 0; band < nbands; band++) {
+            auto const y0 = band * band_rows;
+            auto const y1 = std::min(height, y0 + band_rows);
+            runner.retarget(image, tables);
+            for (int k = 1; k <= iterations; k++) {
+                auto const ext = (iterations - k) * halo;
+                auto const lo = std::max(ssize_t(0), y0 - ext);
+                auto const hi = std::min(height, y1 + ext);
+                if (k == iterations) {
+                    for (ssize_t y = lo; y < hi; y++)
+                        runner.row(y, lut, out + y * row_len);
+                    break;
+                }
+
+                auto *const dst = scratch[k % 2].data();
+                for (ssize_t y = lo; y < hi; y++)
+                    runner.row(y, nullptr, dst + (y - lo) * row_len);
+
+                // Rows read by the next iteration, including ones resolved by the border, are all in [lo, hi)
+                auto const next_lo = std::max(ssize_t(0), y0 - ext + halo);
+                auto const next_hi = std::min(height, y1 + ext - halo);
+                band_image = Image {dst, image.width, int(hi - lo), image.channels};
+                band_tables = sliceTables(tables, next_lo - halo, next_hi + halo, lo, row_len);
+                runner.retarget(band_image, band_tables);
+            }
+        }
+    }
+}
+}  // namespace
+
+void applyPass(Pass const &pass,
+    Image const &image,
+    Border border,
+    int iterations,
+    std::uint8_t const lut[256],
+    std::uint8_t out[]) {
+    auto const halo = pass.halo();
+    auto const tables = makeBorderTables(image, border, halo);
+    if (iterations == 1 || (border != Border::Wrap && halo < image.height))
+        return blockedPasses(pass, image, tables, iterations, lut, out);
+
+    // Border rows of a band could be anywhere in the image, each iteration has to see the whole previous one
+    auto const size = size_t(image.width * image.height * image.channels);
+    std::vector<std::uint8_t> buffers[2] {
+        std::vector<std::uint8_t>(size),
+        std::vector<std::uint8_t>(size),
+    };
+    auto src = image;
+    for (int k = 1; k <= iterations; k++) {
+        auto *const dst = k == iterations ? out : buffers[k % 2].data();
+        blockedPasses(pass, src, tables, 1, k == iterations ? lut : nullptr, dst);
+        src.data = dst;
+    }
+}
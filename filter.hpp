@@ -0,0 +1,155 @@
+#ifndef FILTER_HPP
+#define FILTER_HPP
+
+#include "border.hpp"
+
+#include <cstdint>
+#include <sys/types.h>
+#include <vector>
+
+struct Image {
+    std::uint8_t const *data;
+    int width;
+    int height;
+    int channels;
+};
+
+// Border lookups for one image, computed once so that edge pixels use table loads instead of per-tap border logic.
+// The tables hold the byte offset of the sampled row (or pixel within a row), or -1 where a Border::Constant border
+// means the tap is skipped. Columns cover [-halo, width + halo), rows cover [row_begin, row_begin + rows.size()),
+// which is [-halo, height + halo) for a whole image.
+struct BorderTables {
+    int halo;
+    ssize_t row_begin;
+    std::vector<ssize_t> rows;
+    std::vector<ssize_t> cols;
+
+    ssize_t row(ssize_t y) const noexcept {
+        return rows[size_t(y - row_begin)];
+    }
+
+    ssize_t col(ssize_t x) const noexcept {
+        return cols[size_t(x + halo)];
+    }
+};
+
+BorderTables makeBorderTables(Image const &image, Border border, int halo);
+
+// Tables for rows [begin, end) of the image described by tables, for when only rows [first, ...) of that image are
+// held in a buffer starting at that row. Every row in the range has to map into the buffer.
+BorderTables sliceTables(BorderTables const &tables, ssize_t begin, ssize_t end, ssize_t first, ssize_t row_len);
+
+// Routine computing the interior of a row for one specific kernel, see jit.hpp
+using JitRowFn = void (*)(std::uint8_t const *const rows[], double out[], size_t count);
+
+// Horizontal pass of a separable kernel over bytes [begin, end) of a row, with taps xs
+using HorizontalFn = void (*)(std::uint8_t const src[], double const xs[], double out[], ssize_t begin, ssize_t end);
+
+// A square convolution matrix, indexed as mat[x_offset * size + y_offset]. If the matrix is the outer product of two
+// vectors, mat[x * size + y] == xs[x] * ys[y], it is marked as separable and the factors are filled in.
+//
+// Non-separable built-in matrices known at compile time also carry fixed, which returns a routine specialised on the
+// matrix for a given number of channels (or nullptr), see kernels.hpp.
+struct Kernel {
+    int size;
+    std::vector<double> mat;
+    bool separable;
+    std::vector<double> xs;
+    std::vector<double> ys;
+    JitRowFn (*fixed)(int channels) = nullptr;
+    // Whether a non-separable kernel may use generated code, see planKernel
+    bool jit = true;
+};
+
+Kernel makeKernel(double const mat[], int matsize);
+
+// Convolves an image one output row at a time, writing one sum per byte of the row.
+//
+// Rows are produced by accumulating whole source rows into the output row, vectorised across x, rather than gathering
+// a column of taps for every output pixel. Separable kernels are filtered horizontally first and the filtered rows
+// are kept in a ring, so that consecutive calls only have to filter one new source row each.
+//
+// Taps which land outside of the image are resolved through tables, whose halo has to be at least kernel.size / 2.
+// Only the first and last kernel.size / 2 pixels of a row need per-tap lookups.
+//
+// Kernels with a compile-time specialisation use it for the interior of a row. Otherwise, non-separable kernels use
+// code generated at run time where the machine supports it. Separable kernels of common sizes run both passes with
+// code specialised on the number of taps and channels.
+//
+// Holds per-thread scratch space, each thread should have its own instance.
+class RowConvolver {
+public:
+    RowConvolver(Kernel const &kernel, Image const &image, BorderTables const &tables);
+
+    // Cheapest when called for consecutive rows in increasing order
+    void row(ssize_t y, double out[]) noexcept;
+
+    // Switches to a different source without reallocating scratch space. Width and channels have to stay the same.
+    void retarget(Image const &image, BorderTables const &tables) noexcept;
+
+private:
+    Kernel const &m_kernel;
+    Image const *m_image;
+    BorderTables const *m_tables;
+    std::vector<double> m_ring;
+    std::vector<ssize_t> m_ring_rows;
+    JitRowFn m_row_fn;
+    std::vector<std::uint8_t const *> m_fn_rows;
+    HorizontalFn m_horizontal_fn;
+    std::vector<double const *> m_sum_rows;
+    std::vector<double> m_sum_weights;
+
+    double const *filteredRow(ssize_t y) noexcept;
+    void separableRow(ssize_t y, double out[]) noexcept;
+    void directRow(ssize_t y, double out[]) noexcept;
+};
+
+// Picks how to apply a non-separable kernel without a fixed routine to this image: with generated code, or with the
+// plain loop, which can be faster for large, dense kernels. Both sum in the same order, so the choice never changes the
+// output. Only engines with identical results are considered: separable kernels always run in two passes, as the full
+// matrix would round differently. The choice is made by timing both on a few rows and kept in the disk cache keyed by
+// the kernel, the channel count and the size class of the width, std::bit_width(width). Without a disk cache the
+// generated code is used.
+void planKernel(Kernel &kernel, Image const &image, Border border);
+
+// Size of the last level of cache private to a core, in bytes
+size_t cacheSize() noexcept;
+
+// Threads a parallel region runs on
+int maxThreads() noexcept;
+
+// Number of rows in a band for temporally blocked processing, where each band is double buffered with row_bytes per
+// row and needs halo extra rows above and below. The image is split into at least min_bands bands where it has the
+// rows for it, so that a loop over bands can keep that many threads busy, even if it means more recomputed halo.
+ssize_t bandRows(ssize_t row_bytes, ssize_t halo, ssize_t height, int min_bands = 1) noexcept;
+
+// A single filtering step from bytes to bytes
+struct Pass {
+    enum struct Combine {
+        Copy,       // output the source unchanged
+        Single,     // output the result of kernel
+        Magnitude,  // output sqrt(kernel^2 + kernel_y^2)
+        Absolute,   // output |kernel|
+    };
+    Combine combine;
+    Kernel kernel;
+    Kernel kernel_y;
+
+    int halo() const noexcept;
+};
+
+// Applies pass to the image iterations times, mapping the final result through lut into out.
+//
+// Iterations are temporally blocked: the image is split into bands of rows sized to stay in cache, and each band is
+// taken through all iterations before moving on to the next one. This needs a halo of iterations * pass.halo() rows
+// around every band, which is recomputed by neighbouring bands instead of making a full sweep over the image for
+// every iteration. Wrapping borders, or kernels taller than the image, reach rows outside of the halo, and fall back
+// to one sweep per iteration.
+void applyPass(Pass const &pass,
+    Image const &image,
+    Border border,
+    int iterations,
+    std::uint8_t const lut[256],
+    std::uint8_t out[]);
+
+#endif  // FILTER_HPP
@@ -0,0 +1,97 @@
+#include "hash.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+
+namespace {
+constexpr std::uint32_t round_constants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+std::uint32_t loadBig(std::uint8_t const bytes[4]) noexcept {
+    return std::uint32_t(bytes[0]) << 24 | std::uint32_t(bytes[1]) << 16 | std::uint32_t(bytes[2]) << 8 | bytes[3];
+}
+}  // namespace
+
+void Sha256::compress(std::uint8_t const block[64]) noexcept {
+    std::uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+        w[i] = loadBig(block + 4 * i);
+    for (int i = 16; i < 64; i++) {
+        auto const s0 = std::rotr(w[i - 15], 7) ^ std::rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        auto const s1 = std::rotr(w[i - 2], 17) ^ std::rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    auto a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3];
+    auto e = m_state[4], f = m_state[5], g = m_state[6], h = m_state[7];
+    for (int i = 0; i < 64; i++) {
+        auto const s1 = std::rotr(e, 6) ^ std::rotr(e, 11) ^ std::rotr(e, 25);
+        auto const t1 = h + s1 + ((e & f) ^ (~e & g)) + round_constants[i] + w[i];
+        auto const s0 = std::rotr(a, 2) ^ std::rotr(a, 13) ^ std::rotr(a, 22);
+        auto const t2 = s0 + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    m_state[0] += a;
+    m_state[1] += b;
+    m_state[2] += c;
+    m_state[3] += d;
+    m_state[4] += e;
+    m_state[5] += f;
+    m_state[6] += g;
+    m_state[7] += h;
+}
+
+Sha256 &Sha256::add(void const *data, size_t size) noexcept {
+    auto const *bytes = static_cast<std::uint8_t const *>(data);
+    auto used = size_t(m_size % 64);
+    m_size += size;
+    // Whole blocks are compressed straight from data, only the ends go through m_block
+    if (used) {
+        auto const n = std::min(size, 64 - used);
+        std::memcpy(m_block + used, bytes, n);
+        bytes += n;
+        size -= n;
+        used += n;
+        if (used < 64) return *this;
+        compress(m_block);
+    }
+    for (; size >= 64; bytes += 64, size -= 64)
+        compress(bytes);
+    if (size) std::memcpy(m_block, bytes, size);
+    return *this;
+}
+
+Digest Sha256::digest() const noexcept {
+    auto padded = *this;
+    auto const bits = m_size * 8;
+    std::uint8_t const one = 0x80, zero = 0;
+    padded.add(&one, 1);
+    while (padded.m_size % 64 != 56)
+        padded.add(&zero, 1);
+    std::uint8_t length[8];
+    for (int i = 0; i < 8; i++)
+        length[i] = std::uint8_t(bits >> (56 - 8 * i));
+    padded.add(length, 8);
+
+    Digest out;
+    for (int i = 0; i < 8; i++)
+        for (int j = 0; j < 4; j++)
+            out[size_t(4 * i + j)] = std::uint8_t(padded.m_state[i] >> (24 - 8 * j));
+    return out;
+}
@@ -0,0 +1,65 @@
+#ifndef HASH_HPP
+#define HASH_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <type_traits>
+
+// 64 bit FNV-1a, for cache keys. Not suitable for anything adversarial.
+struct Hasher {
+    std::uint64_t state = 0xcbf29ce484222325ull;
+
+    Hasher &add(void const *data, size_t size) noexcept {
+        auto const *const bytes = static_cast<std::uint8_t const *>(data);
+        for (size_t i = 0; i < size; i++) {
+            state ^= bytes[i];
+            state *= 0x100000001b3ull;
+        }
+        return *this;
+    }
+
+    template<typename T>
+    requires std::is_trivially_copyable_v<T>
+    Hasher &add(T const &value) noexcept {
+        return add(&value, sizeof(value));
+    }
+
+    Hasher &add(std::string_view sv) noexcept {
+        add(sv.size());
+        return add(sv.data(), sv.size());
+    }
+};
+
+using Digest = std::array<std::uint8_t, 32>;
+
+// SHA-256, for when a match has to mean the data really is the same, e.g. where a cache entry could be crafted
+class Sha256 {
+public:
+    Sha256 &add(void const *data, size_t size) noexcept;
+
+    template<typename T>
+    requires std::is_trivially_copyable_v<T>
+    Sha256 &add(T const &value) noexcept {
+        return add(&value, sizeof(value));
+    }
+
+    Sha256 &add(std::string_view sv) noexcept {
+        add(sv.size());
+        return add(sv.data(), sv.size());
+    }
+
+    // Digest of everything added so far. More can still be added afterwards.
+    Digest digest() const noexcept;
+
+private:
+    std::uint32_t m_state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    std::uint8_t m_block[64] {};
+    std::uint64_t m_size = 0;
+
+    void compress(std::uint8_t const block[64]) noexcept;
+};
+
+#endif  // HASH_HPP
@@ -0,0 +1,91 @@
+#define PRINT_FILE stderr
+
+#include "imagecache.hpp"
+
+#include "defer.hpp"
+#include "print.hpp"
+#include "stb_image.h"
+
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iterator>
+
+namespace fs = std::filesystem;
+
+ImageCache::ImageCache(size_t budget)
+        : m_budget(budget) { }
+
+std::shared_ptr<ImageCache::Decoded const> ImageCache::get(std::string const &path, int channels) {
+    std::error_code ec;
+    auto const mtime = std::int64_t(fs::last_write_time(path, ec).time_since_epoch().count());
+    auto const size = ec ? 0 : fs::file_size(path, ec);
+    if (ec) {
+        println("Could not read image {}: {}", path, ec.message());
+        return nullptr;
+    }
+
+    auto const key = std::format("{}:{}", channels, path);
+    if (auto const found = m_index.find(key); found != m_index.end()) {
+        auto const entry = found->second;
+        if (entry->mtime == mtime && entry->size == size) {
+            m_hits++;
+            m_entries.splice(m_entries.begin(), m_entries, entry);
+            return entry->decoded;
+        }
+        drop(entry);
+    }
+    m_misses++;
+
+    std::ifstream in(path, std::ios::binary);
+    auto const data = std::vector<std::uint8_t>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    if (!in && !in.eof()) {
+        println("Could not read image {}", path);
+        return nullptr;
+    }
+    int width, height, image_channels;
+    auto *const image
+        = stbi_load_from_memory(data.data(), int(data.size()), &width, &height, &image_channels, channels);
+    if (!image) {
+        println("Could not load image {}: {}", path, stbi_failure_reason());
+        return nullptr;
+    }
+    defer {
+        stbi_image_free(image);
+    };
+    if (!channels) channels = image_channels;
+    auto const bytes = size_t(width) * size_t(height) * size_t(channels);
+    auto decoded = std::make_shared<Decoded const>(Decoded {{image, image + bytes}, width, height, channels});
+
+    // An image larger than the whole budget would only push everything else out
+    if (bytes > m_budget) return decoded;
+    while (m_bytes + bytes > m_budget)
+        drop(std::prev(m_entries.end()));
+    m_entries.push_front(Entry {key, mtime, size, decoded});
+    m_index.emplace(key, m_entries.begin());
+    m_bytes += bytes;
+    return decoded;
+}
+
+void ImageCache::shrink(size_t bytes) {
+    while (m_bytes > bytes)
+        drop(std::prev(m_entries.end()));
+}
+
+size_t ImageCache::hits() const noexcept {
+    return m_hits;
+}
+
+size_t ImageCache::misses() const noexcept {
+    return m_misses;
+}
+
+size_t ImageCache::bytes() const noexcept {
+    return m_bytes;
+}
+
+void ImageCache::drop(std::list<Entry>::iterator entry) {
+    m_bytes -= entry->decoded->pixels.size();
+    m_index.erase(entry->key);
+    m_entries.erase(entry);
+}
@@ -0,0 +1,62 @@
+#ifndef IMAGECACHE_HPP
+#define IMAGECACHE_HPP
+
+#include "filter.hpp"
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Decoded images, kept for as long as they fit into a memory budget, dropping the least recently used first. Images
+// are looked up by path and the channels they were decoded to, and are only reused while the file has the same mtime
+// and size.
+class ImageCache {
+public:
+    struct Decoded {
+        std::vector<std::uint8_t> pixels;
+        int width;
+        int height;
+        int channels;
+
+        Image image() const noexcept {
+            return Image {pixels.data(), width, height, channels};
+        }
+    };
+
+    explicit ImageCache(size_t budget);
+
+    // The image at path decoded to channels (or its own channels for 0), decoding it if it is not cached. Prints the
+    // reason and returns nullptr if it cannot be read. Images stay valid while they are held, even once dropped.
+    std::shared_ptr<Decoded const> get(std::string const &path, int channels);
+
+    // Drops the least recently used images until no more than bytes are cached
+    void shrink(size_t bytes);
+
+    size_t hits() const noexcept;
+    size_t misses() const noexcept;
+    // Memory taken up by the cached images
+    size_t bytes() const noexcept;
+
+private:
+    struct Entry {
+        std::string key;
+        std::int64_t mtime;
+        std::uintmax_t size;
+        std::shared_ptr<Decoded const> decoded;
+    };
+
+    size_t m_budget;
+    size_t m_bytes = 0;
+    size_t m_hits = 0;
+    size_t m_misses = 0;
+    // Most recently used first
+    std::list<Entry> m_entries;
+    std::unordered_map<std::string, std::list<Entry>::iterator> m_index;
+
+    void drop(std::list<Entry>::iterator entry);
+};
+
+#endif  // IMAGECACHE_HPP
@@ -0,0 +1,123 @@
+#include "incremental.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+// Part of the output covered by a horizontal run of stale tiles, in pixels
+struct Region {
+    int x0, y0, x1, y1;
+};
+}  // namespace
+
+void IncrementalFilter::apply(Image const &image, int halo, Filter const &filter, std::uint8_t out[]) {
+    auto const width = image.width;
+    auto const height = image.height;
+    auto const channels = image.channels;
+    auto const row_len = size_t(width * channels);
+    auto const tiles_x = (width + tile_size - 1) / tile_size;
+    auto const tiles_y = (height + tile_size - 1) / tile_size;
+    m_tiles = tiles_x * tiles_y;
+
+    auto const whole = [&] {
+        filter(image, out);
+        m_dirty = m_tiles;
+        remember(image, halo, out);
+    };
+    if (halo < 0 || halo != m_halo || width != m_width || height != m_height || channels != m_channels)
+        return whole();
+
+    auto dirty = std::vector<std::uint8_t>(size_t(m_tiles));
+#pragma omp parallel for
+    for (int ty = 0; ty < tiles_y; ty++)
+        for (int y = ty * tile_size; y < std::min(height, (ty + 1) * tile_size); y++) {
+            auto const *const now = image.data + size_t(y) * row_len;
+            auto const *const before = m_input.data() + size_t(y) * row_len;
+            for (int tx = 0; tx < tiles_x; tx++) {
+                auto &flag = dirty[size_t(ty * tiles_x + tx)];
+                if (flag) continue;
+                auto const begin = size_t(tx * tile_size * channels);
+                auto const end = std::min(row_len, size_t((tx + 1) * tile_size * channels));
+                flag = std::memcmp(now + begin, before + begin, end - begin) != 0;
+            }
+        }
+
+    // Changes also reach the output of neighbouring tiles within the halo
+    auto const reach = (halo + tile_size - 1) / tile_size;
+    auto stale = std::vector<std::uint8_t>(dirty.size());
+    for (int ty = 0; ty < tiles_y; ty++)
+        for (int tx = 0; tx < tiles_x; tx++) {
+            if (!dirty[size_t(ty * tiles_x + tx)]) continue;
+            for (int y = std::max(0, ty - reach); y <= std::min(tiles_y - 1, ty + reach); y++)
+                for (int x = std::max(0, tx - reach); x <= std::min(tiles_x - 1, tx + reach); x++)
+                    stale[size_t(y * tiles_x + x)] = 1;
+        }
+
+    std::vector<Region> regions;
+    m_dirty = 0;
+    // Filtering a region also covers its halo, past some point it is cheaper to do the whole frame at once
+    std::int64_t work = 0;
+    for (int ty = 0; ty < tiles_y; ty++)
+        for (int tx = 0; tx < tiles_x; tx++) {
+            if (!stale[size_t(ty * tiles_x + tx)]) continue;
+            auto const first = tx;
+            while (tx + 1 < tiles_x && stale[size_t(ty * tiles_x + tx + 1)])
+                tx++;
+            Region const region {
+                first * tile_size,
+                ty * tile_size,
+                std::min(width, (tx + 1) * tile_size),
+                std::min(height, (ty + 1) * tile_size),
+            };
+            regions.push_back(region);
+            m_dirty += tx - first + 1;
+            work += std::int64_t(std::min(width, region.x1 + halo) - std::max(0, region.x0 - halo))
+                  * (std::min(height, region.y1 + halo) - std::max(0, region.y0 - halo));
+        }
+    if (work >= std::int64_t(width) * height) return whole();
+
+    std::memcpy(out, m_output.data(), m_output.size());
+    // A single region is left to the parallelism within the filter
+#pragma omp parallel for schedule(dynamic) if (regions.size() > 1)
+    for (size_t r = 0; r < regions.size(); r++) {
+        auto const &region = regions[r];
+        auto const x0 = std::max(0, region.x0 - halo);
+        auto const y0 = std::max(0, region.y0 - halo);
+        auto const w = std::min(width, region.x1 + halo) - x0;
+        auto const h = std::min(height, region.y1 + halo) - y0;
+        auto const sub_len = size_t(w * channels);
+        std::vector<std::uint8_t> src(sub_len * size_t(h));
+        std::vector<std::uint8_t> dst(src.size());
+        for (int y = 0; y < h; y++)
+            std::memcpy(src.data() + size_t(y) * sub_len,
+                image.data + size_t(y0 + y) * row_len + size_t(x0 * channels),
+                sub_len);
+
+        filter(Image {src.data(), w, h, channels}, dst.data());
+
+        auto const copy_len = size_t((region.x1 - region.x0) * channels);
+        for (int y = region.y0; y < region.y1; y++)
+            std::memcpy(out + size_t(y) * row_len + size_t(region.x0 * channels),
+                dst.data() + size_t(y - y0) * sub_len + size_t((region.x0 - x0) * channels),
+                copy_len);
+    }
+    remember(image, halo, out);
+}
+
+int IncrementalFilter::dirtyTiles() const noexcept {
+    return m_dirty;
+}
+
+int IncrementalFilter::tiles() const noexcept {
+    return m_tiles;
+}
+
+void IncrementalFilter::remember(Image const &image, int halo, std::uint8_t const out[]) {
+    auto const size = size_t(image.width * image.height * image.channels);
+    m_input.assign(image.data, image.data + size);
+    m_output.assign(out, out + size);
+    m_width = image.width;
+    m_height = image.height;
+    m_channels = image.channels;
+    m_halo = halo;
+}
@@ -0,0 +1,46 @@
+#ifndef INCREMENTAL_HPP
+#define INCREMENTAL_HPP
+
+#include "filter.hpp"
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// Filters a sequence of frames, only recomputing the parts of each frame which changed since the previous one.
+//
+// Frames are compared in square tiles. Tiles which changed, and their neighbours within the halo, are stale. Horizontal
+// runs of stale tiles are cut out of the new frame together with a halo, filtered on their own, and pasted over the
+// previous output. The filter has to be local: every output pixel may only depend on source pixels at most halo away,
+// and borders have to be resolved at the edge of the image rather than from its far side. Where the halo reaches the
+// edge of the image, the cut out region ends there as well, so the filter sees the same border as it would for the
+// whole frame.
+class IncrementalFilter {
+public:
+    // Computes out for the whole of image
+    using Filter = std::function<void(Image const &image, std::uint8_t out[])>;
+
+    // Filters image into out. A negative halo means that the filter is not local and the whole frame is recomputed.
+    // The filter has to stay the same between calls, anything else resets the history.
+    void apply(Image const &image, int halo, Filter const &filter, std::uint8_t out[]);
+
+    // Number of tiles recomputed for the last frame, and the total number of tiles
+    int dirtyTiles() const noexcept;
+    int tiles() const noexcept;
+
+private:
+    static constexpr int tile_size = 64;
+
+    std::vector<std::uint8_t> m_input;
+    std::vector<std::uint8_t> m_output;
+    int m_width = 0;
+    int m_height = 0;
+    int m_channels = 0;
+    int m_halo = -1;
+    int m_dirty = 0;
+    int m_tiles = 0;
+
+    void remember(Image const &image, int halo, std::uint8_t const out[]);
+};
+
+#endif  // INCREMENTAL_HPP
@@ -14,25 +14,75 @@
 #    include <unistd.h>
 #endif
 
-void writeCallback(void *context, void *data, int size) noexcept {
-    std::FILE *fp = static_cast<FILE *>(context);
-    std::fwrite(data, 1, size_t(size), fp);
+void appendCallback(void *context, void *data, int size) {
+    auto &out = *static_cast<std::vector<std::uint8_t> *>(context);
+    auto const *const bytes = static_cast<std::uint8_t const *>(data);
+    out.insert(out.end(), bytes, bytes + size);
 }
 
-bool writeImage(File const &file, std::uint8_t image[], int width, int height, int channels) noexcept {
+bool encodeImage(
+    File::Type type, std::uint8_t const image[], int width, int height, int channels, std::vector<std::uint8_t> &out) {
     using enum File::Type;
-    switch (file.type) {
-        case Jpg: return stbi_write_jpg_to_func(writeCallback, file.fp, width, height, channels, image, 100);
-        case Png: return stbi_write_png_to_func(writeCallback, file.fp, width, height, channels, image, 0);
-        case Tga: return stbi_write_tga_to_func(writeCallback, file.fp, width, height, channels, image);
-        case Bmp: return stbi_write_bmp_to_func(writeCallback, file.fp, width, height, channels, image);
-        case Invalid: println("Impossible state: invalid file type when writing"); std::abort();
+    out.clear();
+    switch (type) {
+        case Jpg: return stbi_write_jpg_to_func(appendCallback, &out, width, height, channels, image, 100);
+        case Png: return stbi_write_png_to_func(appendCallback, &out, width, height, channels, image, 0);
+        case Tga: return stbi_write_tga_to_func(appendCallback, &out, width, height, channels, image);
+        case Bmp: return stbi_write_bmp_to_func(appendCallback, &out, width, height, channels, image);
+        case Invalid: println("Impossible state: invalid file type when encoding"); std::abort();
+        case Y4m: println("Impossible state: encoding an image as a video stream"); std::abort();
     }
-    println("Impossible state: unhandled file type when writing");
+    println("Impossible state: unhandled file type when encoding");
     std::abort();
 }
 
-File File::open(char const *name, File::Mode mode, File::Type type) noexcept {
+std::optional<std::vector<std::uint8_t>> readAll(File const &file) {
+    std::vector<std::uint8_t> data;
+    std::uint8_t buf[1 << 16];
+    for (size_t n; (n = std::fread(buf, 1, sizeof(buf), file.fp));)
+        data.insert(data.end(), buf, buf + n);
+    if (std::ferror(file.fp)) return std::nullopt;
+    return data;
+}
+
+bool writeAll(File const &file, std::uint8_t const data[], size_t size) noexcept {
+    return std::fwrite(data, 1, size, file.fp) == size && !std::fflush(file.fp);
+}
+
+File::Type File::typeFromName(char const *name) noexcept {
+    using enum File::Type;
+    auto const ex = std::filesystem::path(name).extension();
+    if (ex == ".jpg") return Jpg;
+    if (ex == ".tga") return Tga;
+    if (ex == ".bmp") return Bmp;
+    if (ex == ".png") return Png;
+    if (ex == ".y4m") return Y4m;
+    return Invalid;
+}
+
+File::Type File::typeFromData(std::uint8_t const data[], size_t size) noexcept {
+    using enum File::Type;
+    static constexpr std::uint8_t bmp_magic[] = {0x42, 0x4d};
+    static constexpr std::uint8_t jpg_magic[] = {0xff, 0xd8, 0xff, 0xe0};
+    static constexpr std::uint8_t png_magic[] = {0x89, 0x50, 0x4e, 0x47};
+    static constexpr std::uint8_t y4m_magic[] = {'Y', 'U', 'V', '4'};
+
+    if (size < 4) return Invalid;
+    bool is_bmp = true, is_jpg = true, is_png = true, is_y4m = true;
+    for (int i = 0; i < 4; i++) {
+        if (i == 2 && is_bmp) return Bmp;
+        is_bmp = is_bmp && data[i] == bmp_magic[i];
+        is_jpg = is_jpg && data[i] == jpg_magic[i];
+        is_png = is_png && data[i] == png_magic[i];
+        is_y4m = is_y4m && data[i] == y4m_magic[i];
+    }
+    if (is_jpg) return Jpg;
+    if (is_png) return Png;
+    if (is_y4m) return Y4m;
+    return Invalid;
+}
+
+std::optional<File> File::tryOpen(char const *name, File::Mode mode, File::Type type) noexcept {
     using enum File::Mode;
     FILE *const fp = [&] {
         if (name[0] == '-')
@@ -43,49 +93,41 @@ File File::open(char const *name, File::Mode mode, File::Type type) noexcept {
 
     if (!fp) {
         println("Could not open file {} for {}: {}", name, mode == Read ? "reading" : "writing", std::strerror(errno));
-        exit(1);
+        return std::nullopt;
     }
+    // Owns fp until the type is known
+    auto file = File(name, fp, Type::Invalid);
 
     type = [&] {
         using enum File::Type;
-        if (auto ex = std::filesystem::path(name).extension(); ex == ".jpg")
-            return Jpg;
-        else if (ex == ".tga")
-            return Tga;
-        else if (ex == ".bmp")
-            return Bmp;
-        else if (ex == ".png")
-            return Png;
+        if (auto const from_name = typeFromName(name); from_name != Invalid)
+            return from_name;
         else if (mode == Write)
             return type;
         else {
             std::uint8_t dest[4];
             if (std::fread(dest, 1, 4, fp) != 4) {
                 println("could not read file {}", name);
-                exit(1);
+                return Invalid;
             }
             // note: can't just rewind, because file may be stdin
             for (int i = 3; i >= 0; i--)
                 std::ungetc(dest[i], fp);
 
-            static constexpr std::uint8_t bmp_magic[] = {0x42, 0x4d};
-            static constexpr std::uint8_t jpg_magic[] = {0xff, 0xd8, 0xff, 0xe0};
-            static constexpr std::uint8_t png_magic[] = {0x89, 0x50, 0x4e, 0x47};
-
-            bool is_bmp = true, is_jpg = true, is_png = true;
-            for (int i = 0; i < 4; i++) {
-                if (i == 2 && is_bmp) return Bmp;
-                is_bmp = is_bmp && dest[i] == bmp_magic[i];
-                is_jpg = is_jpg && dest[i] == jpg_magic[i];
-                is_png = is_png && dest[i] == png_magic[i];
-            }
-            if (is_jpg) return Jpg;
-            if (is_png) return Png;
+            if (auto const from_data = typeFromData(dest, 4); from_data != Invalid) return from_data;
             println("Could not determine input file type from magic, please use the -.extention syntax to specify");
-            exit(1);
+            return Invalid;
         }
     }();
-    return File(name, fp, type);
+    if (mode == Read && type == File::Type::Invalid) return std::nullopt;
+    file.type = type;
+    return file;
+}
+
+File File::open(char const *name, File::Mode mode, File::Type type) noexcept {
+    auto file = tryOpen(name, mode, type);
+    if (!file) exit(1);
+    return std::move(*file);
 }
 
 File::File(File &&other) noexcept
@@ -2,15 +2,27 @@
 #define WRITER_HPP
 #include <cstdint>
 #include <cstdio>
+#include <optional>
 #include <utility>
+#include <vector>
 
 struct File {
-    enum struct Type { Invalid, Jpg, Png, Tga, Bmp };
+    // Y4m is a YUV4MPEG2 video stream rather than an image, see y4m.hpp
+    enum struct Type { Invalid, Jpg, Png, Tga, Bmp, Y4m };
     enum struct Mode { Read, Write };
     char const *name;
     std::FILE *fp;
     Type type;
+    // Exits on failure
     static File open(char const *name, File::Mode mode, File::Type type = File::Type::Invalid) noexcept;
+    // Prints the reason and returns nullopt on failure
+    static std::optional<File> tryOpen(
+        char const *name, File::Mode mode, File::Type type = File::Type::Invalid) noexcept;
+    // The type implied by the extension of name, or Invalid
+    static Type typeFromName(char const *name) noexcept;
+    // The type implied by the magic at the start of size bytes of data, or Invalid. Tga has no magic, so is never
+    // detected.
+    static Type typeFromData(std::uint8_t const data[], size_t size) noexcept;
     File(File const &) = delete;
     File operator=(File const &) = delete;
 
@@ -21,7 +33,14 @@ private:
     File(char const *name, std::FILE *fp, Type type) noexcept;
 };
 
-bool writeImage(File const &file, std::uint8_t image[], int width, int height, int channels) noexcept;
+// Encodes the image in the given format into out
+bool encodeImage(
+    File::Type type, std::uint8_t const image[], int width, int height, int channels, std::vector<std::uint8_t> &out);
+
+// Reads whatever is left of the file
+std::optional<std::vector<std::uint8_t>> readAll(File const &file);
+
+bool writeAll(File const &file, std::uint8_t const data[], size_t size) noexcept;
 
 
 
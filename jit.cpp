@@ -0,0 +1,239 @@
+#include "jit.hpp"
+
+#include "cache.hpp"
+#include "hash.hpp"
+
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__x86_64__) && defined(__unix__)
+#    include <sys/mman.h>
+#    define JIT_SUPPORTED
+#endif
+
+#ifdef JIT_SUPPORTED
+namespace {
+// Just enough of an x86-64 assembler for the routines below. Every memory operand uses a 32 bit displacement, and all
+// vector instructions use the 3 byte VEX prefix.
+class Assembler {
+public:
+    enum Gpr { rax = 0, rdx = 2, rsi = 6, rdi = 7, r8 = 8 };
+
+    struct Mem {
+        int base;  // -1 for a constant from the pool, disp is then its index
+        int index;
+        int scale;
+        std::int32_t disp;
+    };
+
+    size_t pos() const noexcept {
+        return m_code.size();
+    }
+
+    void bytes(std::initializer_list<int> bs) {
+        for (auto b : bs)
+            m_code.push_back(std::uint8_t(b));
+    }
+
+    void dword(std::int32_t d) {
+        for (int i = 0; i < 4; i++)
+            m_code.push_back(std::uint8_t(std::uint32_t(d) >> (8 * i)));
+    }
+
+    Mem constant(double value) {
+        m_pool.push_back(value);
+        return Mem {-1, -1, 0, std::int32_t(m_pool.size() - 1)};
+    }
+
+    // VEX encoded instruction with a register or memory as the r/m operand
+    void vex(int map, int pp, bool l, int opcode, int reg, int vvvv, int rm) {
+        vexPrefix(map, pp, l, reg, vvvv, 0, rm);
+        bytes({opcode, 0xc0 | (reg & 7) << 3 | (rm & 7)});
+    }
+
+    void vex(int map, int pp, bool l, int opcode, int reg, int vvvv, Mem const &rm) {
+        vexPrefix(map, pp, l, reg, vvvv, rm.index < 0 ? 0 : rm.index, rm.base < 0 ? 0 : rm.base);
+        bytes({opcode});
+        modrm(reg, rm);
+    }
+
+    // mov r64, [rm]
+    void load(int reg, Mem const &rm) {
+        auto const rex = 0x48 | (reg & 8) >> 1 | (rm.index >= 0 ? (rm.index & 8) >> 2 : 0) | (rm.base & 8) >> 3;
+        bytes({rex, 0x8b});
+        modrm(reg, rm);
+    }
+
+    // Conditional jump with a 32 bit offset, returns the position of the offset for patch()
+    size_t jcc(int cc, size_t target = 0) {
+        bytes({0x0f, 0x80 | cc});
+        auto const at = pos();
+        dword(std::int32_t(target) - std::int32_t(at + 4));
+        return at;
+    }
+
+    void patch(size_t at) {
+        auto const d = std::int32_t(pos()) - std::int32_t(at + 4);
+        std::memcpy(m_code.data() + at, &d, sizeof(d));
+    }
+
+    // Appends the constant pool and resolves references to it
+    std::vector<std::uint8_t> finish() {
+        while (m_code.size() % sizeof(double))
+            m_code.push_back(0xcc);
+        auto const pool = m_code.size();
+        m_code.resize(pool + m_pool.size() * sizeof(double));
+        std::memcpy(m_code.data() + pool, m_pool.data(), m_pool.size() * sizeof(double));
+        for (auto const &[at, idx] : m_fixups) {
+            auto const d = std::int32_t(pool + size_t(idx) * sizeof(double)) - std::int32_t(at + 4);
+            std::memcpy(m_code.data() + at, &d, sizeof(d));
+        }
+        return std::move(m_code);
+    }
+
+private:
+    std::vector<std::uint8_t> m_code;
+    std::vector<double> m_pool;
+    std::vector<std::pair<size_t, std::int32_t>> m_fixups;
+
+    void vexPrefix(int map, int pp, bool l, int reg, int vvvv, int x, int b) {
+        bytes({
+            0xc4,
+            (~reg & 8) << 4 | (~x & 8) << 3 | (~b & 8) << 2 | map,
+            (~vvvv & 15) << 3 | int(l) << 2 | pp,
+        });
+    }
+
+    void modrm(int reg, Mem const &rm) {
+        if (rm.base < 0) {
+            bytes({(reg & 7) << 3 | 5});
+            m_fixups.emplace_back(pos(), rm.disp);
+            dword(0);
+        } else if (rm.index < 0 && (rm.base & 7) != 4) {
+            bytes({0x80 | (reg & 7) << 3 | (rm.base & 7)});
+            dword(rm.disp);
+        } else {
+            bytes({0x84 | (reg & 7) << 3, rm.scale << 6 | ((rm.index < 0 ? 4 : rm.index) & 7) << 3 | (rm.base & 7)});
+            dword(rm.disp);
+        }
+    }
+};
+
+// Maps and pp values of the VEX prefix
+constexpr int map_0f = 1, map_0f38 = 2;
+constexpr int pp_66 = 1, pp_f3 = 2;
+
+// Each loop iteration produces 8 sums in two accumulators, ymm0 and ymm1. Every non-zero tap broadcasts its weight into
+// ymm2, widens 2x4 source bytes into ymm3 and ymm4, multiplies and adds.
+std::vector<std::uint8_t> generate(Kernel const &kernel, int channels) {
+    using A = Assembler;
+    A a;
+    auto const size = kernel.size;
+    auto const halfmat = size / 2;
+    auto const vxorpd = [&](int r) { a.vex(map_0f, pp_66, true, 0x57, r, r, r); };
+    auto const vbroadcastsd = [&](int r, A::Mem const &m) { a.vex(map_0f38, pp_66, true, 0x19, r, 0, m); };
+    auto const vpmovzxbd = [&](int r, A::Mem const &m) { a.vex(map_0f38, pp_66, false, 0x31, r, 0, m); };
+    auto const vcvtdq2pd = [&](int r, int src) { a.vex(map_0f, pp_f3, true, 0xe6, r, 0, src); };
+    auto const vmulpd = [&](int r, int src1, int src2) { a.vex(map_0f, pp_66, true, 0x59, r, src1, src2); };
+    auto const vaddpd = [&](int r, int src1, int src2) { a.vex(map_0f, pp_66, true, 0x58, r, src1, src2); };
+    auto const vmovupd = [&](A::Mem const &m, int r) { a.vex(map_0f, pp_66, true, 0x11, r, 0, m); };
+
+    // rdi: rows, rsi: out, rdx: count, rax: byte index, r8: current row
+    a.bytes({0x31, 0xc0});        // xor eax, eax
+    a.bytes({0x48, 0x85, 0xd2});  // test rdx, rdx
+    auto const skip = a.jcc(0x4);  // jz done
+    auto const loop = a.pos();
+    vxorpd(0);
+    vxorpd(1);
+    for (int jmat = 0; jmat < size; jmat++) {
+        auto loaded = false;
+        for (int imat = 0; imat < size; imat++) {
+            auto const w = kernel.mat[size_t(imat * size + jmat)];
+            if (w == 0.) continue;
+            if (!loaded) a.load(A::r8, A::Mem {A::rdi, -1, 0, jmat * 8});
+            loaded = true;
+
+            auto const shift = (imat - halfmat) * channels;
+            vbroadcastsd(2, a.constant(w));
+            vpmovzxbd(3, A::Mem {A::r8, A::rax, 0, shift});
+            vpmovzxbd(4, A::Mem {A::r8, A::rax, 0, shift + 4});
+            vcvtdq2pd(3, 3);
+            vcvtdq2pd(4, 4);
+            vmulpd(3, 3, 2);
+            vmulpd(4, 4, 2);
+            vaddpd(0, 0, 3);
+            vaddpd(1, 1, 4);
+        }
+    }
+    vmovupd(A::Mem {A::rsi, A::rax, 3, 0}, 0);
+    vmovupd(A::Mem {A::rsi, A::rax, 3, 32}, 1);
+    a.bytes({0x48, 0x83, 0xc0, 0x08});  // add rax, 8
+    a.bytes({0x48, 0x39, 0xd0});        // cmp rax, rdx
+    a.jcc(0x2, loop);                   // jb loop
+    a.patch(skip);
+    a.bytes({0xc5, 0xf8, 0x77});  // vzeroupper
+    a.bytes({0xc3});              // ret
+    return a.finish();
+}
+
+JitRowFn install(std::vector<std::uint8_t> const &code) {
+    auto *const mem = mmap(nullptr, code.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return nullptr;
+    std::memcpy(mem, code.data(), code.size());
+    if (mprotect(mem, code.size(), PROT_READ | PROT_EXEC)) {
+        munmap(mem, code.size());
+        return nullptr;
+    }
+    return reinterpret_cast<JitRowFn>(mem);
+}
+
+// The generated code is position independent and only depends on the kernel and the channel count, so it is kept in
+// the disk cache as is. Entries start with the matrix they were generated for, to rule out key collisions.
+JitRowFn compile(Kernel const &kernel, int channels) {
+    auto const mat_bytes = kernel.mat.size() * sizeof(double);
+    auto const key = diskcache::key("jit").add(channels).add(kernel.mat.data(), mat_bytes).state;
+    if (auto const entry = diskcache::load("jit", key);
+        entry && entry->size() > mat_bytes && !std::memcmp(entry->data(), kernel.mat.data(), mat_bytes))
+        return install(std::vector<std::uint8_t>(entry->begin() + std::ptrdiff_t(mat_bytes), entry->end()));
+
+    auto const code = generate(kernel, channels);
+    if (diskcache::enabled()) {
+        std::vector<std::uint8_t> entry(mat_bytes + code.size());
+        std::memcpy(entry.data(), kernel.mat.data(), mat_bytes);
+        std::memcpy(entry.data() + mat_bytes, code.data(), code.size());
+        diskcache::store("jit", key, entry.data(), entry.size());
+    }
+    return install(code);
+}
+
+struct CacheEntry {
+    int channels;
+    std::vector<double> mat;
+    JitRowFn fn;
+};
+}  // namespace
+
+JitRowFn jitCompile(Kernel const &kernel, int channels) {
+    static bool const supported = __builtin_cpu_supports("avx2");
+    if (!supported || kernel.size == 0) return nullptr;
+
+    auto const hash = Hasher {}.add(channels).add(kernel.mat.data(), kernel.mat.size() * sizeof(double)).state;
+    static std::mutex mutex;
+    // Kernels whose hashes collide are kept side by side
+    static std::unordered_map<std::uint64_t, std::vector<CacheEntry>> cache;
+    std::lock_guard const lock(mutex);
+    auto &entries = cache[hash];
+    for (auto const &entry : entries)
+        if (entry.channels == channels && entry.mat == kernel.mat) return entry.fn;
+
+    auto const fn = compile(kernel, channels);
+    entries.push_back(CacheEntry {channels, kernel.mat, fn});
+    return fn;
+}
+#else
+JitRowFn jitCompile(Kernel const &, int) {
+    return nullptr;
+}
+#endif
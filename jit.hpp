@@ -0,0 +1,21 @@
+#ifndef JIT_HPP
+#define JIT_HPP
+
+#include "filter.hpp"
+
+#include <cstddef>
+#include <cstdint>
+
+// Computes out[b] = sum(mat[i * size + j] * rows[j][b + i * channels]) for b in [0, count), with i and j running over
+// the whole matrix, centered on 0 for i. count has to be a multiple of 8. The sums are accumulated in the same order
+// as RowConvolver does, so results are identical. The JitRowFn type is declared in filter.hpp.
+
+// Returns a routine generated for this exact kernel and channel count, with the weights baked in and zero taps left
+// out, or nullptr if code generation is not supported on this machine.
+//
+// Routines are cached for the lifetime of the process by a hash of the kernel, so later images filtered with the
+// same matrix reuse the code. When the disk cache is enabled, the code is also kept there for later invocations.
+// Safe to call from multiple threads.
+JitRowFn jitCompile(Kernel const &kernel, int channels);
+
+#endif  // JIT_HPP
@@ -0,0 +1,179 @@
+#define PRINT_FILE stderr
+
+#include "jobs.hpp"
+
+#include "args.hpp"
+#include "cache.hpp"
+#include "io.hpp"
+#include "process.hpp"
+#include "stb_image.h"
+
+#include "print.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <format>
+#include <fstream>
+#include <mutex>
+#include <numeric>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace {
+struct Job {
+    char const *input;
+    char const *output;
+    Options opts;
+    double cost;
+    // Estimated peak, in bytes
+    size_t memory;
+};
+
+// Memory shared by the jobs running at the same time. Jobs which do not fit wait for others to finish, and one larger
+// than the whole budget waits until it can run alone. Jobs are admitted in the order they asked, so that a large job
+// is not starved by smaller ones which keep fitting in around it.
+class MemoryBudget {
+public:
+    // No limit for 0
+    explicit MemoryBudget(size_t bytes)
+            : m_bytes(bytes) { }
+
+    void acquire(size_t bytes) {
+        if (!m_bytes) return;
+        std::unique_lock lock(m_mutex);
+        auto const ticket = m_next_ticket++;
+        m_freed.wait(lock, [&] { return ticket == m_serving && (m_used == 0 || m_used + bytes <= m_bytes); });
+        m_used += bytes;
+        m_serving++;
+        // The next in line may fit as well
+        m_freed.notify_all();
+    }
+
+    void release(size_t bytes) {
+        if (!m_bytes) return;
+        {
+            std::lock_guard lock(m_mutex);
+            m_used -= bytes;
+        }
+        m_freed.notify_all();
+    }
+
+private:
+    size_t m_bytes;
+    size_t m_used = 0;
+    std::uint64_t m_next_ticket = 0;
+    std::uint64_t m_serving = 0;
+    std::mutex m_mutex;
+    std::condition_variable m_freed;
+};
+
+// Fills in the cost and memory of the job from the header of the image only. Both are left at 0 if it cannot be read,
+// which leaves reporting that to the job.
+void estimate(Job &job) {
+    int width, height, channels;
+    if (!stbi_info(job.input, &width, &height, &channels)) return;
+    if (job.opts.channels) channels = job.opts.channels;
+    job.cost = double(width) * height * channels * byteCost(job.opts);
+    std::error_code ec;
+    auto const encoded = fs::file_size(job.input, ec);
+    job.memory = memoryFootprint(job.opts, width, height, channels) + (ec ? 0 : size_t(encoded));
+}
+
+int runJob(Job const &job) {
+    auto const infile = File::tryOpen(job.input, File::Mode::Read);
+    if (!infile) return 1;
+    auto const outfile = File::tryOpen(job.output, File::Mode::Write, infile->type);
+    if (!outfile) return 1;
+    return processImage(job.opts, *infile, *outfile);
+}
+}  // namespace
+
+int runJobs(char const *program, JobsOptions const &settings) {
+    auto const *const path = settings.file;
+    std::ifstream in(path);
+    if (!in) {
+        println("Could not open job file {}", path);
+        return 1;
+    }
+
+    // Options point into the arguments, so they have to stay in place
+    std::deque<std::string> storage;
+    std::vector<Job> jobs;
+    std::vector<std::string> fields;
+    char const *cache_dir = nullptr;
+    std::string line;
+    for (int n = 1; std::getline(in, line); n++) {
+        if (!splitArgs(line, fields)) {
+            println("{}:{}: unterminated quote", path, n);
+            return 1;
+        }
+        if (fields.empty() || fields[0].starts_with('#')) continue;
+        if (fields.size() < 2) {
+            println("{}:{}: expected INFILE OUTFILE [OPTS]", path, n);
+            return 1;
+        }
+        if (fields[0].starts_with('-') || fields[1].starts_with('-')) {
+            println("{}:{}: jobs cannot use stdin or stdout", path, n);
+            return 1;
+        }
+
+        std::vector<char *> argv {storage.emplace_back(program).data()};
+        for (auto &field : fields)
+            argv.push_back(storage.emplace_back(std::move(field)).data());
+        auto const parsed = tryArgs(int(argv.size()), argv.data(), std::format("{}:{}", path, n));
+        if (!parsed) return 1;
+        auto const &[input, output, opts] = *parsed;
+        if (std::string_view(input).starts_with("shm:") || std::string_view(output).starts_with("shm:")) {
+            println("{}:{}: jobs cannot use shared memory", path, n);
+            return 1;
+        }
+        if (std::error_code ec; opts.watch || fs::is_directory(input, ec)) {
+            println("{}:{}: jobs have to be single images", path, n);
+            return 1;
+        }
+        // The disk cache is shared by the whole process
+        if (opts.cache_dir && cache_dir && std::string_view(opts.cache_dir) != cache_dir) {
+            println("{}:{}: all jobs have to use the same cache directory", path, n);
+            return 1;
+        }
+        if (opts.cache_dir) cache_dir = opts.cache_dir;
+        jobs.push_back(Job {input, output, opts, 0., 0});
+    }
+    if (cache_dir) diskcache::enable(cache_dir);
+
+    for (auto &job : jobs) {
+        estimate(job);
+        if (settings.memory && job.memory > settings.memory)
+            println("{} needs about {} MiB, more than the memory budget, it will run on its own",
+                job.input,
+                job.memory >> 20);
+    }
+    std::stable_sort(jobs.begin(), jobs.end(), [](Job const &a, Job const &b) { return a.cost > b.cost; });
+    auto const threads
+        = settings.workers > 0 ? settings.workers : std::max(1, int(std::thread::hardware_concurrency()));
+    auto const total = std::accumulate(jobs.begin(), jobs.end(), 0., [](double sum, Job const &job) {
+        return sum + job.cost;
+    });
+    auto const big = size_t(std::find_if(jobs.begin(), jobs.end(), [&](Job const &job) {
+        return job.cost * threads <= total;
+    }) - jobs.begin());
+
+    int failed = 0;
+    for (size_t i = 0; i < big; i++)
+        failed += runJob(jobs[i]) != 0;
+    MemoryBudget budget(settings.memory);
+    // Parallel regions within a job are nested in the pool's and run on the worker's thread alone
+#pragma omp parallel for schedule(dynamic, 1) num_threads(threads) reduction(+ : failed)
+    for (size_t i = big; i < jobs.size(); i++) {
+        budget.acquire(jobs[i].memory);
+        failed += runJob(jobs[i]) != 0;
+        budget.release(jobs[i].memory);
+    }
+
+    println("{} jobs, {} failed.", jobs.size(), failed);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,20 @@
+#ifndef JOBS_HPP
+#define JOBS_HPP
+
+#include "args.hpp"
+
+// Runs every job listed in settings.file, one per line as INFILE OUTFILE [OPTS] with the same options as on the
+// command line. Empty lines and lines starting with # are skipped, arguments may be quoted with ' or ".
+//
+// Jobs are scheduled by their estimated cost, from the size of the image (read from its header) and the work the
+// filter does per pixel. Jobs which would take longer than an even share of the whole batch run first, one at a time
+// using all threads. The rest run side by side on a pool of workers threads, one thread each, largest first, so that
+// the jobs left at the end are short and the pool stays busy.
+//
+// With a memory budget, a job on the pool only starts once its estimated peak memory fits alongside the jobs already
+// running. Jobs larger than the whole budget wait until they can run alone.
+//
+// Returns the exit status for main.
+int runJobs(char const *program, JobsOptions const &settings);
+
+#endif  // JOBS_HPP
@@ -0,0 +1,125 @@
+#ifndef KERNELS_HPP
+#define KERNELS_HPP
+
+#include "filter.hpp"
+
+#include <cstdint>
+#include <sys/types.h>
+#include <utility>
+
+// Built-in matrices, indexed the same way as Kernel::mat
+
+// clang-format off
+constexpr double sobelX[][9] = {
+    {
+        1., 0., -1.,
+        2., 0., -2.,
+        1., 0., -1.,
+    },
+    {
+        3., 0.,  -3.,
+       10., 0., -10.,
+        3., 0.,  -3.,
+    },
+    {
+       47., 0.,  -47.,
+      162., 0., -162.,
+       47., 0.,  -47.,
+    }
+};
+constexpr double sobelY[][9] = {
+    {
+        1.,  2.,  1.,
+        0.,  0.,  0.,
+       -1., -2., -1.,
+    },
+    {
+        3.,  10.,  3.,
+        0.,   0.,  0.,
+       -3., -10., -3.,
+    },
+    {
+       47.,  162.,  47.,
+         0.,   0.,   0.,
+      -47., -162., -47.,
+    },
+};
+
+// Binomial approximations of a Gaussian
+constexpr double binomial3[9] = {
+    1. / 16, 2. / 16, 1. / 16,
+    2. / 16, 4. / 16, 2. / 16,
+    1. / 16, 2. / 16, 1. / 16,
+};
+constexpr double binomial5[25] = {
+    1. / 256,  4. / 256,  6. / 256,  4. / 256, 1. / 256,
+    4. / 256, 16. / 256, 24. / 256, 16. / 256, 4. / 256,
+    6. / 256, 24. / 256, 36. / 256, 24. / 256, 6. / 256,
+    4. / 256, 16. / 256, 24. / 256, 16. / 256, 4. / 256,
+    1. / 256,  4. / 256,  6. / 256,  4. / 256, 1. / 256,
+};
+
+constexpr double laplace[9] = {
+    0.,  1., 0.,
+    1., -4., 1.,
+    0.,  1., 0.,
+};
+// clang-format on
+
+namespace detail {
+template<int N, double const (&K)[N * N], int C, int T>
+inline double fixedTap(double sum, std::uint8_t const *const rows[], ssize_t b) noexcept {
+    constexpr auto jmat = T / N;
+    constexpr auto imat = T % N;
+    constexpr auto w = K[imat * N + jmat];
+    if constexpr (w == 0.)
+        return sum;
+    else
+        return sum + rows[jmat][b + (imat - N / 2) * C] * w;
+}
+
+// Straight-line row routine with every weight and offset known at compile time, taps are summed in the same order as
+// RowConvolver does
+template<int N, double const (&K)[N * N], int C>
+void fixedRow(std::uint8_t const *const rows[], double out[], size_t count) noexcept {
+    auto const n = ssize_t(count);
+#pragma omp simd
+    for (ssize_t b = 0; b < n; b++) {
+        auto sum = 0.;
+        [&]<int... T>(std::integer_sequence<int, T...>) {
+            ((sum = fixedTap<N, K, C, T>(sum, rows, b)), ...);
+        }(std::make_integer_sequence<int, N * N> {});
+        out[b] = sum;
+    }
+}
+
+template<int N, double const (&K)[N * N]>
+JitRowFn fixedRowFor(int channels) {
+    switch (channels) {
+        case 1: return fixedRow<N, K, 1>;
+        case 2: return fixedRow<N, K, 2>;
+        case 3: return fixedRow<N, K, 3>;
+        case 4: return fixedRow<N, K, 4>;
+    }
+    return nullptr;
+}
+}  // namespace detail
+
+// Kernel for a non-separable matrix known at compile time, whose rows are computed by code specialised on it.
+// Separable matrices are better off with makeKernel, their two passes are specialised on the kernel size.
+template<int N, double const (&K)[N * N]>
+Kernel makeFixedKernel() {
+    auto kernel = makeKernel(K, N);
+    if (!kernel.separable) kernel.fixed = detail::fixedRowFor<N, K>;
+    return kernel;
+}
+
+inline Kernel makeSobelXKernel(int type) {
+    return makeKernel(sobelX[type], 3);
+}
+
+inline Kernel makeSobelYKernel(int type) {
+    return makeKernel(sobelY[type], 3);
+}
+
+#endif  // KERNELS_HPP
@@ -0,0 +1,53 @@
+#define PRINT_FILE stderr
+
+#include "metrics.hpp"
+
+#include "print.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <format>
+#include <iterator>
+
+namespace metrics {
+void Histogram::observe(double seconds) noexcept {
+    auto const bucket = std::lower_bound(bounds.begin(), bounds.end(), seconds) - bounds.begin();
+    m_counts[size_t(bucket)]++;
+    m_sum += seconds;
+}
+
+void Histogram::render(std::string &out, std::string_view name, std::string_view labels) const {
+    auto const sep = labels.empty() ? "" : ",";
+    std::uint64_t total = 0;
+    for (size_t i = 0; i < bounds.size(); i++) {
+        total += m_counts[i];
+        std::format_to(std::back_inserter(out), "{}_bucket{{{}{}le=\"{}\"}} {}\n", name, labels, sep, bounds[i], total);
+    }
+    total += m_counts.back();
+    std::format_to(std::back_inserter(out), "{}_bucket{{{}{}le=\"+Inf\"}} {}\n", name, labels, sep, total);
+    std::format_to(std::back_inserter(out), "{}_sum{{{}}} {}\n", name, labels, m_sum);
+    std::format_to(std::back_inserter(out), "{}_count{{{}}} {}\n", name, labels, total);
+}
+
+void describe(std::string &out, std::string_view name, std::string_view type, std::string_view help) {
+    std::format_to(std::back_inserter(out), "# HELP {} {}\n# TYPE {} {}\n", name, help, name, type);
+}
+
+bool write(char const *path, std::string_view text) noexcept {
+    auto const tmp = std::format("{}.tmp", path);
+    auto *const file = std::fopen(tmp.c_str(), "wb");
+    if (!file) {
+        println("Could not write metrics to {}: {}", tmp, std::strerror(errno));
+        return false;
+    }
+    auto const ok = std::fwrite(text.data(), 1, text.size(), file) == text.size();
+    if (std::fclose(file) != 0 || !ok || std::rename(tmp.c_str(), path) != 0) {
+        println("Could not write metrics to {}: {}", path, std::strerror(errno));
+        std::remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+}  // namespace metrics
@@ -0,0 +1,37 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Helpers for exposing counters in the Prometheus text format
+namespace metrics {
+// Distribution of durations, in seconds
+class Histogram {
+public:
+    void observe(double seconds) noexcept;
+
+    // Appends the _bucket, _sum and _count series of name, with labels (e.g. stage="decode") added to each
+    void render(std::string &out, std::string_view name, std::string_view labels) const;
+
+private:
+    // Upper bounds of the buckets, the last bucket (+Inf) takes everything else
+    static constexpr std::array bounds {
+        .0005, .001, .0025, .005, .01, .025, .05, .1, .25, .5, 1., 2.5, 5., 10.};
+
+    std::array<std::uint64_t, bounds.size() + 1> m_counts {};
+    double m_sum = 0;
+};
+
+// Appends the # HELP and # TYPE lines for name
+void describe(std::string &out, std::string_view name, std::string_view type, std::string_view help);
+
+// Replaces the file at path with text, through a temporary file so that a scraper never sees it half written. Prints a
+// warning and returns false if it cannot be written.
+bool write(char const *path, std::string_view text) noexcept;
+}  // namespace metrics
+
+#endif  // METRICS_HPP
@@ -0,0 +1,206 @@
+#include "plugin.hpp"
+
+#define PRINT_FILE stderr
+#include "print.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <dlfcn.h>
+#include <memory>
+#include <vector>
+
+namespace {
+constexpr ssize_t alignment = 64;
+
+ssize_t alignUp(ssize_t n) noexcept {
+    return (n + alignment - 1) / alignment * alignment;
+}
+
+struct AlignedFree {
+    void operator()(std::uint8_t *p) const noexcept {
+        std::free(p);
+    }
+};
+
+using AlignedBuffer = std::unique_ptr<std::uint8_t[], AlignedFree>;
+
+AlignedBuffer allocAligned(ssize_t size) {
+    auto const bytes = size_t(alignUp(std::max(size, ssize_t(1))));
+    return AlignedBuffer(static_cast<std::uint8_t *>(std::aligned_alloc(size_t(alignment), bytes)));
+}
+}  // namespace
+
+std::optional<Plugin> Plugin::load(char const *path, char const *options) noexcept {
+    auto *const handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        println("Could not load plugin {}: {}", path, dlerror());
+        return std::nullopt;
+    }
+    auto const fail = [&](char const *why) -> std::optional<Plugin> {
+        println("Could not load plugin {}: {}", path, why);
+        dlclose(handle);
+        return std::nullopt;
+    };
+
+    auto const entry = reinterpret_cast<convolve_plugin_entry_fn>(dlsym(handle, "convolve_plugin_entry"));
+    if (!entry) return fail("convolve_plugin_entry is not exported");
+    auto const *const desc = entry();
+    if (!desc) return fail("convolve_plugin_entry returned NULL");
+    if (desc->abi_version != CONVOLVE_PLUGIN_ABI_VERSION) return fail("incompatible ABI version");
+    if (!desc->process_tile) return fail("process_tile is not set");
+    if (desc->halo < 0) return fail("negative halo");
+    if (desc->layout != CONVOLVE_INTERLEAVED && desc->layout != CONVOLVE_PLANAR) return fail("unknown layout");
+
+    void *state = nullptr;
+    if (desc->create && !(state = desc->create(options))) return fail("plugin rejected its options");
+    return Plugin(handle, desc, state);
+}
+
+Plugin::Plugin(void *handle, convolve_plugin const *desc, void *state) noexcept
+        : m_handle(handle)
+        , m_desc(desc)
+        , m_state(state) { }
+
+Plugin::Plugin(Plugin &&other) noexcept
+        : m_handle(nullptr)
+        , m_desc(nullptr)
+        , m_state(nullptr) {
+    *this = std::move(other);
+}
+
+Plugin &Plugin::operator=(Plugin &&other) noexcept {
+    if (this == &other) return *this;
+    std::swap(m_handle, other.m_handle);
+    std::swap(m_desc, other.m_desc);
+    std::swap(m_state, other.m_state);
+    return *this;
+}
+
+Plugin::~Plugin() noexcept {
+    if (!m_handle) return;
+    if (m_desc->destroy) m_desc->destroy(m_state);
+    dlclose(m_handle);
+}
+
+char const *Plugin::name() const noexcept {
+    return m_desc->name ? m_desc->name : "unnamed";
+}
+
+char const *Plugin::description() const noexcept {
+    return m_desc->description ? m_desc->description : "";
+}
+
+bool Plugin::apply(
+    Image const &image, Border border, int iterations, std::uint8_t const lut[256], std::uint8_t out[]) const {
+    auto const tables = makeBorderTables(image, border, m_desc->halo);
+    if (iterations == 1) return applyOnce(image, tables, lut, out);
+
+    auto const size = size_t(image.width * image.height * image.channels);
+    std::vector<std::uint8_t> buffers[2] {
+        std::vector<std::uint8_t>(size),
+        std::vector<std::uint8_t>(size),
+    };
+    auto src = image;
+    for (int k = 1; k <= iterations; k++) {
+        auto *const dst = k == iterations ? out : buffers[k % 2].data();
+        if (!applyOnce(src, tables, k == iterations ? lut : nullptr, dst)) return false;
+        src.data = dst;
+    }
+    return true;
+}
+
+bool Plugin::applyOnce(
+    Image const &image, BorderTables const &tables, std::uint8_t const lut[256], std::uint8_t out[]) const {
+    auto const halo = ssize_t(m_desc->halo);
+    auto const width = ssize_t(image.width);
+    auto const height = ssize_t(image.height);
+    auto const channels = image.channels;
+    auto const row_len = width * channels;
+    auto const planar = m_desc->layout == CONVOLVE_PLANAR;
+
+    // Planar buffers hold one plane per channel, each plane has the same layout as a single channel image
+    auto const px = planar ? 1 : channels;
+    auto const planes = planar ? channels : 1;
+    auto const src_stride = alignUp((width + 2 * halo) * px);
+    auto const dst_stride = alignUp(width * px);
+    auto const band_rows = bandRows(src_stride * planes, halo, height, maxThreads());
+    auto const src_plane = src_stride * (band_rows + 2 * halo);
+    auto const dst_plane = dst_stride * band_rows;
+    auto const nbands = (height + band_rows - 1) / band_rows;
+    std::atomic<bool> ok = true;
+    std::atomic<bool> reported = false;
+
+#pragma omp parallel
+    {
+        auto const src = allocAligned(src_plane * planes);
+        auto const dst = allocAligned(dst_plane * planes);
+        // Every thread still has to take part in the loop below, a thread without buffers just skips its bands
+        if ((!src || !dst) && !reported.exchange(true)) {
+            println("Could not allocate {} bytes of tile buffers for plugin {}",
+                (src_plane + dst_plane) * planes,
+                name());
+        }
+
+#pragma omp for schedule(dynamic)
+        for (ssize_t band = 0; band < nbands; band++) {
+            if (!src || !dst) {
+                ok = false;
+                continue;
+            }
+            auto const y0 = band * band_rows;
+            auto const y1 = std::min(height, y0 + band_rows);
+
+            for (ssize_t y = y0 - halo; y < y1 + halo; y++) {
+                auto const offset = tables.row(y);
+                auto *const row = src.get() + (y - y0 + halo) * src_stride;
+                for (ssize_t x = -halo; x < width + halo; x++) {
+                    // Interleaved rows can take the interior in one go
+                    if (!planar && x == 0 && offset >= 0) {
+                        std::memcpy(row + halo * channels, image.data + offset, size_t(row_len));
+                        x = width - 1;
+                        continue;
+                    }
+                    auto const col = tables.col(x);
+                    for (int ch = 0; ch < channels; ch++) {
+                        auto const v = offset < 0 || col < 0 ? std::uint8_t(0) : image.data[offset + col + ch];
+                        if (planar)
+                            row[ch * src_plane + x + halo] = v;
+                        else
+                            row[(x + halo) * channels + ch] = v;
+                    }
+                }
+            }
+
+            convolve_tile const tile {
+                src.get() + halo * src_stride + halo * px,
+                dst.get(),
+                int(width),
+                int(y1 - y0),
+                int(y0),
+                channels,
+                int(halo),
+                src_stride,
+                dst_stride,
+                planar ? src_plane : 0,
+                planar ? dst_plane : 0,
+            };
+            if (m_desc->process_tile(m_state, &tile)) {
+                ok = false;
+                continue;
+            }
+
+            for (ssize_t y = y0; y < y1; y++) {
+                auto const *const row = dst.get() + (y - y0) * dst_stride;
+                auto *const dest = out + y * row_len;
+                for (ssize_t x = 0; x < width; x++)
+                    for (int ch = 0; ch < channels; ch++) {
+                        auto const v = planar ? row[ch * dst_plane + x] : row[x * channels + ch];
+                        dest[x * channels + ch] = lut ? lut[v] : v;
+                    }
+            }
+        }
+    }
+    return ok;
+}
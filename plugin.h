@@ -0,0 +1,71 @@
+/* Filter plugin ABI.
+ *
+ * A plugin is a shared object exporting
+ *
+ *     struct convolve_plugin const *convolve_plugin_entry(void);
+ *
+ * which is loaded with `convolve -p PATH`. The tool takes care of decoding, encoding, border handling, tiling and
+ * threading, the plugin only has to filter tiles.
+ *
+ * Images are split into tiles of whole rows. Every source tile is surrounded by `halo` pixels on each side, filled
+ * in according to the selected border mode, so a plugin never has to check bounds. Rows of both buffers start on
+ * 64 byte boundaries.
+ *
+ * process_tile is called concurrently from multiple threads with different tiles, and has to be thread safe.
+ */
+#ifndef CONVOLVE_PLUGIN_H
+#define CONVOLVE_PLUGIN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CONVOLVE_PLUGIN_ABI_VERSION 1
+
+enum convolve_layout {
+    CONVOLVE_INTERLEAVED = 0, /* RGBRGB..., one buffer */
+    CONVOLVE_PLANAR = 1,      /* RRR...GGG...BBB..., one plane per channel */
+};
+
+struct convolve_tile {
+    /* First pixel of the tile proper, the halo lies before and after it: src[-halo * src_stride - halo * channels]
+     * (interleaved) or src[-halo * src_stride - halo] (planar) is the top left pixel of the halo. */
+    uint8_t const *src;
+    uint8_t *dst;
+    int width;    /* in pixels, excluding the halo */
+    int rows;     /* in pixels, excluding the halo */
+    int y;        /* row of the image the tile starts at */
+    int channels; /* 1 to 4 */
+    int halo;
+    ptrdiff_t src_stride; /* bytes between rows */
+    ptrdiff_t dst_stride;
+    ptrdiff_t src_plane_stride; /* bytes between planes, planar layout only */
+    ptrdiff_t dst_plane_stride;
+};
+
+struct convolve_plugin {
+    uint32_t abi_version; /* CONVOLVE_PLUGIN_ABI_VERSION */
+    char const *name;
+    char const *description;
+    int halo;   /* pixels needed around each output pixel */
+    int layout; /* enum convolve_layout */
+
+    /* Optional. Called once before any tiles with the string given to --plugin-opt (or NULL). The result is passed to
+     * process_tile and destroy. Returning NULL is treated as an error if create is set. */
+    void *(*create)(char const *options);
+    void (*destroy)(void *state);
+
+    /* Filters one tile, returns 0 on success */
+    int (*process_tile)(void const *state, struct convolve_tile const *tile);
+};
+
+typedef struct convolve_plugin const *(*convolve_plugin_entry_fn)(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CONVOLVE_PLUGIN_H */
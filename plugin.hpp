@@ -0,0 +1,41 @@
+#ifndef PLUGIN_HPP
+#define PLUGIN_HPP
+
+#include "filter.hpp"
+#include "plugin.h"
+
+#include <cstdint>
+#include <optional>
+
+// A filter loaded from a shared object, see plugin.h for the ABI
+class Plugin {
+public:
+    // Prints the reason and returns nullopt if the plugin cannot be loaded or rejects the options
+    static std::optional<Plugin> load(char const *path, char const *options) noexcept;
+    Plugin(Plugin const &) = delete;
+    Plugin &operator=(Plugin const &) = delete;
+
+    Plugin(Plugin &&other) noexcept;
+    Plugin &operator=(Plugin &&other) noexcept;
+    ~Plugin() noexcept;
+
+    char const *name() const noexcept;
+    char const *description() const noexcept;
+
+    // Applies the plugin to the image iterations times, mapping the final result through lut into out. The image is
+    // split into bands of rows sized to stay in cache, which are copied into aligned buffers with their halo filled
+    // in according to border and filtered in parallel. Returns false if the plugin reported an error.
+    bool apply(
+        Image const &image, Border border, int iterations, std::uint8_t const lut[256], std::uint8_t out[]) const;
+
+private:
+    void *m_handle;
+    convolve_plugin const *m_desc;
+    void *m_state;
+
+    Plugin(void *handle, convolve_plugin const *desc, void *state) noexcept;
+    bool applyOnce(
+        Image const &image, BorderTables const &tables, std::uint8_t const lut[256], std::uint8_t out[]) const;
+};
+
+#endif  // PLUGIN_HPP
@@ -0,0 +1,523 @@
+#define PRINT_FILE stderr
+
+#include "process.hpp"
+
+#include "cache.hpp"
+#include "defer.hpp"
+#include "diffusion.hpp"
+#include "filter.hpp"
+#include "io.hpp"
+#include "kernels.hpp"
+#include "plugin.hpp"
+#include "shard.hpp"
+#include "print.hpp"
+#include "stb_image.h"
+#include "stb_image_write.h"
+#include "y4m.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <tuple>
+#include <vector>
+
+namespace timing {
+namespace chr = std::chrono;
+#ifdef TIMING
+// Jobs may run side by side, each thread times its own
+static thread_local chr::time_point<chr::high_resolution_clock> start_point;
+static thread_local chr::time_point<chr::high_resolution_clock> stop_point;
+
+void start() noexcept {
+    start_point = chr::high_resolution_clock::now();
+}
+
+void stop() noexcept {
+    stop_point = chr::high_resolution_clock::now();
+}
+
+template<typename Precision = chr::microseconds>
+void report() noexcept {
+    auto took = double(chr::duration_cast<Precision>(stop_point - start_point).count())
+              / double(chr::duration_cast<Precision>(chr::seconds(1)).count());
+    println("Took {}s", took);
+}
+#else
+void start() noexcept { }
+
+void stop() noexcept { }
+
+template<typename Precision = chr::microseconds>
+void report() noexcept { }
+#endif
+}  // namespace timing
+
+double G(int x, int y, double sigma) noexcept {
+    auto const sigma_2 = sigma * sigma;
+    auto const frac = 1. / (2. * M_PI * sigma_2);
+    auto const ex = exp(-(x * x + y * y) / (2. * sigma_2));
+    return frac * ex;
+}
+
+double *makeGaussMat(int size, double sigma) {
+    auto const size_2 = size_t(size * size);
+    auto *out = new double[size_2];
+    auto const mid = size / 2;
+    auto sum = 0.;
+    for (int i = 0; i < size; i++)
+        for (int j = 0; j < size; j++) {
+            out[j * size + i] = G(i - mid, j - mid, sigma);
+            sum += out[j * size + i];
+        }
+    for (size_t i = 0; i < size_2; i++)
+        out[i] /= sum;
+
+    return out;
+}
+
+double *makeAvgMat(int size) {
+    auto const size_2 = size_t(size * size);
+    auto *out = new double[size_2];
+    for (size_t i = 0; i < size_2; i++)
+        out[i] = 1. / double(size_2);
+
+    return out;
+}
+
+double *reportCustomMatError(char const *custom_mat, size_t pos, char const *error = "") {
+    println("Custom matrix specification error: {}\n"
+            "\n"
+            "\t{}\n"
+            "\t{:>{}}\n",
+        error,
+        custom_mat,
+        '^',
+        pos);
+    return nullptr;
+}
+
+double *makeCustomMat(char const *custom_mat, int size) {
+    std::string_view sv = custom_mat;
+    auto const size_2 = size_t(size * size);
+    auto out = std::make_unique<double[]>(size_2);
+    for (int i = 0; i < size; i++) {
+        for (int j = 0; j < size; j++) {
+            char *end;
+            out[size_t(i * size + j)] = std::strtod(sv.data(), &end);
+            auto success = true;
+            if (j == size - 1) {
+                if (i == size - 1)
+                    success = end[0] == 0 || end[0] == '|';
+                else
+                    success = end[0] == '|';
+            } else {
+                success = end[0] == ',';
+            }
+            if (!success) return reportCustomMatError(custom_mat, size_t(end - custom_mat));
+            end += !(i == size - 1 && j == size - 1);
+            sv = std::string_view(end, sv.end());
+        }
+    }
+    if (sv.size() == 0 || (sv.size() == 1 && sv[0] == '|')) {
+        auto const sum = std::reduce(out.get(), out.get() + size_2, 0);
+        if (sum != 0)
+            for (size_t i = 0; i < size_2; i++)
+                out[i] /= sum;
+        return out.release();
+    } else
+        return reportCustomMatError(custom_mat, sv.size(), "Extra characters");
+}
+
+void customMatPrinter(double mat[], int matsize) {
+    size_t const max_w = std::transform_reduce(
+        mat,
+        mat + matsize * matsize,
+        0ul,
+        [](size_t x, size_t y) { return std::max(x, y); },
+        [](double x) { return std::formatted_size("{:.2}", x); });
+    size_t line_max_w = 0;
+    for (int i = 0; i < matsize; i++) {
+        size_t line_w = 2;
+        for (int j = 0; j < matsize; j++)
+            line_w += std::formatted_size("{:>{}.2} ", mat[i * matsize + j], max_w) + 1;
+        line_w -= 2;
+        line_max_w = std::max(line_max_w, line_w);
+    };
+    println("custom matrix: ");
+    auto const [w, _] = getTermWH();
+    if (line_max_w > w) {
+        println("Matrix too big to display");
+        return;
+    }
+    println("┌{:>{}}┐", "", line_max_w);
+    for (int i = 0; i < matsize; i++) {
+        print("│");
+        for (int j = 0; j < matsize; j++)
+            print(" {:>{}.2} ", mat[i * matsize + j], max_w);
+
+        println("│");
+    }
+    println("└{:>{}}┘", "", line_max_w);
+}
+
+inline constexpr auto threshold(auto const &x, auto const &lo, auto hi) {
+    if (x <= lo) return std::numeric_limits<std::remove_cvref_t<decltype(x)>>::min();
+    if (x >= hi) return std::numeric_limits<std::remove_cvref_t<decltype(x)>>::max();
+    return x;
+}
+
+bool isIdentity(std::uint8_t const lut[256]) noexcept {
+    for (int i = 0; i < 256; i++)
+        if (lut[i] != i) return false;
+    return true;
+}
+
+double byteCost(Options const &opts) {
+    auto const taps = [&] {
+        switch (opts.alg) {
+            case Alg::Gauss:
+            case Alg::Avg:
+            case Alg::Binomial: return 2. * opts.matsize;
+            case Alg::Custom: return double(opts.matsize) * opts.matsize;
+            case Alg::Sobel: return 12.;
+            case Alg::Laplace: return 9.;
+            case Alg::Diffusion: return 12.;
+            case Alg::Plugin: return 9.;
+            case Alg::None: break;
+        }
+        return 0.;
+    }();
+    // Decoding and encoding take about as long as a few taps
+    static constexpr double codec = 4.;
+    return taps * opts.iterations + codec;
+}
+
+size_t memoryFootprint(Options const &opts, int width, int height, int channels) {
+    auto const bytes = size_t(width) * size_t(height) * size_t(channels);
+    // The decoded image, the filtered one, and the encoded output, which is about as large for the formats written
+    auto total = 3 * bytes;
+    // Every iteration sees the whole previous one, see applyPass
+    if (opts.iterations > 1 && opts.border == Border::Wrap && opts.alg != Alg::Diffusion) total += 2 * bytes;
+    // The previous frame and its output
+    if (opts.diff_frames) total += 2 * bytes;
+    // Between them, the workers hold every band and its output, and the halos around the bands
+    if (opts.shards > 1) total += 2 * bytes;
+    return total;
+}
+
+namespace {
+// Adds everything in opts which affects the output to hasher, a Hasher or a Sha256
+template<typename H>
+void hashOptions(H &hasher, Options const &opts) {
+    hasher.add(opts.matsize).add(opts.channels).add(opts.sobel_type).add(opts.sigma);
+    hasher.add(opts.th_lo).add(opts.th_hi).add(opts.alg).add(opts.border).add(opts.iterations);
+    hasher.add(opts.kappa).add(opts.lambda).add(opts.temporal).add(opts.window).add(opts.time_sigma);
+    for (auto const *str : {opts.custom_mat, opts.plugin, opts.plugin_opts, opts.convert_to})
+        hasher.add(str != nullptr).add(std::string_view(str ? str : ""));
+    // A rebuilt plugin can produce different results from the same options
+    if (std::error_code ec; opts.plugin) {
+        hasher.add(std::filesystem::file_size(opts.plugin, ec));
+        hasher.add(std::filesystem::last_write_time(opts.plugin, ec).time_since_epoch().count());
+    }
+}
+}  // namespace
+
+std::uint64_t optionsHash(Options const &opts) {
+    Hasher hasher;
+    hashOptions(hasher, opts);
+    return hasher.state;
+}
+
+Digest optionsDigest(Options const &opts) {
+    Sha256 hasher;
+    hashOptions(hasher, opts);
+    return hasher.digest();
+}
+
+// Digest of the encoded output of filtering input with options digested to options_digest into a file of the given
+// type. Entries start with it, so that a key which collides, by chance or by a crafted input, is not mistaken for a
+// hit.
+Digest outputDigest(Digest const &options_digest, File::Type type, std::vector<std::uint8_t> const &input) {
+    auto hasher = Sha256 {}.add(diskcache::key("out").state).add(options_digest).add(type);
+    return hasher.add(input.size()).add(input.data(), input.size()).digest();
+}
+
+// Whether the encoded input is already of type. Tga has no magic, so is taken from the name.
+bool sameType(std::vector<std::uint8_t> const &input, char const *name, File::Type type) noexcept {
+    auto const from_data = File::typeFromData(input.data(), input.size());
+    if (from_data != File::Type::Invalid) return from_data == type;
+    return type == File::Type::Tga && File::typeFromName(name) == File::Type::Tga;
+}
+
+std::optional<Processor> Processor::create(Options const &opts) {
+    auto mat = std::unique_ptr<double[]>([&] {
+        switch (opts.alg) {
+            case Alg::Gauss: return makeGaussMat(opts.matsize, opts.sigma);
+            case Alg::Avg: return makeAvgMat(opts.matsize);
+            case Alg::Custom: return makeCustomMat(opts.custom_mat, opts.matsize);
+            case Alg::Sobel:
+            case Alg::Binomial:
+            case Alg::Laplace:
+            case Alg::Diffusion:
+            case Alg::Plugin:
+            case Alg::None: break;
+        }
+        return static_cast<double *>(nullptr);
+    }());
+    if (opts.alg == Alg::Custom && !mat) {
+        println("Failed to create matrix");
+        return std::nullopt;
+    }
+
+    auto plugin = opts.alg == Alg::Plugin ? Plugin::load(opts.plugin, opts.plugin_opts) : std::nullopt;
+    if (opts.alg == Alg::Plugin && !plugin) return std::nullopt;
+
+    auto pass = [&] {
+        using enum Pass::Combine;
+        switch (opts.alg) {
+            case Alg::Gauss:
+            case Alg::Avg:
+            case Alg::Custom: return Pass {Single, makeKernel(mat.get(), opts.matsize), {}};
+            case Alg::Sobel:
+                return Pass {Magnitude, makeSobelXKernel(opts.sobel_type), makeSobelYKernel(opts.sobel_type)};
+            case Alg::Binomial:
+                if (opts.matsize == 3) return Pass {Single, makeKernel(binomial3, 3), {}};
+                return Pass {Single, makeKernel(binomial5, 5), {}};
+            case Alg::Laplace: return Pass {Absolute, makeFixedKernel<3, laplace>(), {}};
+            case Alg::Diffusion:
+            case Alg::Plugin:
+            case Alg::None: break;
+        }
+        return Pass {Copy, {}, {}};
+    }();
+    return Processor(opts, std::move(mat), std::move(pass), std::move(plugin));
+}
+
+Processor::Processor(Options const &opts, std::unique_ptr<double[]> mat, Pass pass, std::optional<Plugin> plugin)
+        : m_opts(opts)
+        , m_options_digest(opts.cache_outputs ? optionsDigest(opts) : Digest {})
+        , m_mat(std::move(mat))
+        , m_pass(std::move(pass))
+        , m_plugin(std::move(plugin)) {
+    for (int i = 0; i < 256; i++)
+        m_lut[i] = threshold(stbi_uc(i), opts.th_lo, opts.th_hi);
+    m_identity_lut = isIdentity(m_lut);
+}
+
+int Processor::process(File const &infile, File const &outfile, IncrementalFilter *frames) {
+    auto const input = readAll(infile);
+    if (!input) {
+        println("Could not read image {}", infile.name);
+        return 1;
+    }
+    auto const *const name = infile.name[0] == '-' ? "stdin" : infile.name;
+    if (auto const status = process(*input, name, outfile.type, m_encoded, frames)) return status;
+    if (!writeAll(outfile, m_encoded.data(), m_encoded.size())) {
+        println("Could not write image to {}", outfile.name);
+        return 1;
+    }
+    return 0;
+}
+
+int Processor::process(std::vector<std::uint8_t> const &input,
+    char const *name,
+    File::Type type,
+    std::vector<std::uint8_t> &output,
+    IncrementalFilter *frames) {
+    auto const digest = m_opts.cache_outputs ? outputDigest(m_options_digest, type, input) : Digest {};
+    std::uint64_t key;
+    std::memcpy(&key, digest.data(), sizeof(key));
+    if (auto cached = m_opts.cache_outputs ? diskcache::load("out", key) : std::nullopt;
+        cached && cached->size() >= digest.size() && std::equal(digest.begin(), digest.end(), cached->begin())) {
+        println("input image {}: output found in cache.", name);
+        output.assign(cached->begin() + std::ptrdiff_t(digest.size()), cached->end());
+        return 0;
+    }
+    int width, height, image_channels;
+
+    // Nothing to do to the pixels, so an image which is already in the output format is passed on as it is rather
+    // than decoded and encoded again. 16 bit images would be cut down to 8 bits when decoded, so are still converted.
+    if (m_opts.alg == Alg::None && m_identity_lut && sameType(input, name, type)
+        && stbi_info_from_memory(input.data(), int(input.size()), &width, &height, &image_channels)
+        && (!m_opts.channels || m_opts.channels == image_channels)
+        && !stbi_is_16_bit_from_memory(input.data(), int(input.size()))) {
+        println(
+            "input image {}: ({}x{})@{}. Copied, already in the output format.", name, width, height, image_channels);
+        output = input;
+        m_times = {};
+        return 0;
+    }
+
+    auto image = stbi_load_from_memory(
+        input.data(), int(input.size()), &width, &height, &image_channels, m_opts.channels);
+    defer {
+        stbi_image_free(image);
+    };
+    auto const channels = m_opts.channels ? m_opts.channels : image_channels;
+    if (!image) {
+        println("Could not load image {}: {}", name, stbi_failure_reason());
+        return 1;
+    }
+
+    // Only the threshold to apply, which is done where the image was decoded rather than into a copy
+    auto const thresholded = m_opts.alg == Alg::None && !m_identity_lut;
+    if (thresholded) applyLut(image, size_t(width) * size_t(height) * size_t(channels), m_lut, image);
+    auto const status
+        = filterAndEncode(Image {image, width, height, channels}, name, type, output, frames, thresholded);
+    if (!status && m_opts.cache_outputs) {
+        std::vector<std::uint8_t> entry(digest.begin(), digest.end());
+        entry.insert(entry.end(), output.begin(), output.end());
+        diskcache::store("out", key, entry.data(), entry.size());
+    }
+    return status;
+}
+
+int Processor::process(Image const &src,
+    char const *name,
+    File::Type type,
+    std::vector<std::uint8_t> &output,
+    IncrementalFilter *frames) {
+    return filterAndEncode(src, name, type, output, frames, false);
+}
+
+int Processor::filterAndEncode(Image const &src,
+    char const *name,
+    File::Type type,
+    std::vector<std::uint8_t> &output,
+    IncrementalFilter *frames,
+    bool thresholded) {
+    auto const width = src.width;
+    auto const height = src.height;
+    auto const channels = src.channels;
+    print("input image {}: ({}x{})@{}. Using ", name, width, height, channels);
+    describe();
+
+    timing::start();
+    auto const started = std::chrono::steady_clock::now();
+    // Format conversions are encoded straight from the decoded image
+    auto const *filtered_image = src.data;
+    auto const alg = m_opts.alg;
+    if (alg != Alg::None || !(thresholded || m_identity_lut)) {
+        m_output.resize(size_t(width) * size_t(height) * size_t(channels));
+        auto *const image_copy = m_output.data();
+        auto const shards = m_opts.shards;
+        if (frames || shards < 2 || alg == Alg::None ? !filter(src, m_lut, image_copy, frames)
+                                                     : !filterSharded(*this, src, image_copy, shards))
+            return 1;
+        if (frames && frames->dirtyTiles() < frames->tiles())
+            println("Refiltered {} of {} tiles.", frames->dirtyTiles(), frames->tiles());
+        filtered_image = image_copy;
+    }
+    timing::stop();
+    auto const filtered = std::chrono::steady_clock::now();
+    if (!encodeImage(type, filtered_image, width, height, channels, output)) {
+        println("Could not encode image {}", name);
+        return 1;
+    }
+    m_times = {std::chrono::duration<double>(filtered - started).count(),
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - filtered).count()};
+    timing::report();
+    return 0;
+}
+
+void Processor::applyLut(
+    std::uint8_t const in[], size_t size, std::uint8_t const lut[256], std::uint8_t out[]) const noexcept {
+    if (lut == m_lut ? m_identity_lut : isIdentity(lut)) {
+        if (in != out) std::copy(in, in + size, out);
+        return;
+    }
+    auto const n = ssize_t(size);
+    if (lut != m_lut) {
+#pragma omp parallel for
+        for (ssize_t i = 0; i < n; i++)
+            out[i] = lut[in[i]];
+        return;
+    }
+    // The threshold worked out rather than looked up, which vectorises
+    auto const lo = m_opts.th_lo;
+    auto const hi = m_opts.th_hi;
+#pragma omp parallel for simd
+    for (ssize_t i = 0; i < n; i++)
+        out[i] = in[i] <= lo ? 0 : in[i] >= hi ? 255 : in[i];
+}
+
+void Processor::describe() const {
+    auto const &opts = m_opts;
+    switch (opts.alg) {
+        case Alg::Gauss: println("Gausian blur, σ = {}, size = {}.", opts.sigma, opts.matsize); break;
+        case Alg::Sobel: println("Sobel filter, type {}.", opts.sobel_type); break;
+        case Alg::Custom: customMatPrinter(m_mat.get(), opts.matsize); break;
+        case Alg::Avg: println("averaging."); break;
+        case Alg::Binomial: println("binomial blur, size = {}.", opts.matsize); break;
+        case Alg::Laplace: println("Laplace filter."); break;
+        case Alg::Plugin: println("plugin {}: {}", m_plugin->name(), m_plugin->description()); break;
+        case Alg::Diffusion: println("anisotropic diffusion, κ = {}, λ = {}.", opts.kappa, opts.lambda); break;
+        case Alg::None: println("nothing."); break;
+    }
+    if (opts.alg != Alg::None && opts.alg != Alg::Diffusion) println("Border mode: {}.", borderName(opts.border));
+    if (opts.iterations > 1) println("Applying {} times.", opts.iterations);
+}
+
+bool Processor::filter(Image const &src, std::uint8_t const lut[256], std::uint8_t out[], IncrementalFilter *frames) {
+    // Copying is the same however many times it is done, and needs no border
+    if (m_opts.alg == Alg::None) {
+        applyLut(src.data, size_t(src.width) * size_t(src.height) * size_t(src.channels), lut, out);
+        return true;
+    }
+    if (m_opts.alg == Alg::Plugin) {
+        if (m_plugin->apply(src, m_opts.border, m_opts.iterations, lut, out)) return true;
+        println("Plugin {} failed", m_plugin->name());
+        return false;
+    }
+    auto const &pass = plannedPass(src);
+    auto const filter = [&](Image const &image, std::uint8_t dst[]) {
+        if (m_opts.alg == Alg::Diffusion)
+            diffuse(image, m_opts.iterations, m_opts.kappa, m_opts.lambda, lut, dst);
+        else
+            applyPass(pass, image, m_opts.border, m_opts.iterations, lut, dst);
+    };
+    if (frames)
+        frames->apply(src, halo(), filter, out);
+    else
+        filter(src, out);
+    return true;
+}
+
+Pass const &Processor::plannedPass(Image const &image) {
+    // Called for every plane of a Y4M stream, and planning reads and checksums a disk cache entry each time
+    auto const width_class = int(std::bit_width(unsigned(image.width)));
+    for (auto const &plan : m_plans)
+        if (plan.width_class == width_class && plan.channels == image.channels) return plan.pass;
+    auto &plan = m_plans.emplace_back(Plan {width_class, image.channels, m_pass});
+    planKernel(plan.pass.kernel, image, m_opts.border);
+    return plan.pass;
+}
+
+int Processor::halo() const noexcept {
+    // Diffusion does not sample outside of the image, wrapping borders sample its far side
+    if (m_opts.alg == Alg::Plugin || (m_opts.alg != Alg::Diffusion && m_opts.border == Border::Wrap)) return -1;
+    return m_opts.iterations * (m_opts.alg == Alg::Diffusion ? 1 : m_pass.halo());
+}
+
+int processImage(Options const &opts, File const &infile, File const &outfile) {
+    using enum File::Type;
+    if (infile.type == Y4m && outfile.type == Y4m) return processStream(opts, infile, outfile);
+    if (infile.type == Y4m || outfile.type == Y4m) {
+        println("Y4M streams can only be filtered into Y4M streams");
+        return 1;
+    }
+    if (opts.temporal != Temporal::None) {
+        println("Temporal filters need a Y4M stream or shared memory");
+        return 1;
+    }
+    auto processor = Processor::create(opts);
+    return processor ? processor->process(infile, outfile) : 1;
+}
@@ -0,0 +1,133 @@
+#ifndef PROCESS_HPP
+#define PROCESS_HPP
+
+#include "args.hpp"
+#include "filter.hpp"
+#include "hash.hpp"
+#include "incremental.hpp"
+#include "io.hpp"
+#include "plugin.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <vector>
+
+// Everything needed to filter images with one set of options, set up once so that it can be reused for any number of
+// images: matrices and kernels, plugins, and the buffers images are filtered into.
+class Processor {
+public:
+    // Prints the reason and returns nullopt if the options cannot be used, e.g. for a bad matrix or plugin
+    static std::optional<Processor> create(Options const &opts);
+
+    // Filters the image in infile and writes it to outfile, printing what is being done. Returns the exit status for
+    // main.
+    //
+    // With frames, the image is treated as the next frame of a sequence and only the parts which changed since the
+    // previous one are filtered again, where the filter allows it.
+    int process(File const &infile, File const &outfile, IncrementalFilter *frames = nullptr);
+
+    // Same as above for an image which has already been read, encoding the result into output as type. name is only
+    // used in messages. If the pixels are left as they are and input is already of type, it is copied as it is.
+    int process(std::vector<std::uint8_t> const &input,
+        char const *name,
+        File::Type type,
+        std::vector<std::uint8_t> &output,
+        IncrementalFilter *frames = nullptr);
+
+    // Same as above for an image which has already been decoded, without the output cache
+    int process(Image const &image,
+        char const *name,
+        File::Type type,
+        std::vector<std::uint8_t> &output,
+        IncrementalFilter *frames = nullptr);
+
+    // Filters an image which is already decoded into out, mapping the result through lut rather than the threshold of
+    // the options. Frames are handled as for process. Prints the reason and returns false if a plugin failed.
+    bool filter(
+        Image const &image, std::uint8_t const lut[256], std::uint8_t out[], IncrementalFilter *frames = nullptr);
+
+    // How far from each output pixel the filter samples, through all iterations, or -1 if it is not local, i.e. if
+    // parts of an image cannot be filtered on their own
+    int halo() const noexcept;
+
+    // Prints the filter and its settings, as the rest of a line started by the caller
+    void describe() const;
+
+    Options const &options() const noexcept {
+        return m_opts;
+    }
+
+    // Maps filtered values to the output, from the threshold
+    std::uint8_t const *lut() const noexcept {
+        return m_lut;
+    }
+
+    // How long the last image which was decoded took to filter and to encode, in seconds
+    struct Times {
+        double filter;
+        double encode;
+    };
+
+    Times times() const noexcept {
+        return m_times;
+    }
+
+private:
+    Options m_opts;
+    // Of the options, for output cache entries
+    Digest m_options_digest;
+    std::unique_ptr<double[]> m_mat;
+    Pass m_pass;
+    // m_pass as planned for each size class of the width and channel count seen so far, see planKernel
+    struct Plan {
+        int width_class;
+        int channels;
+        Pass pass;
+    };
+    std::vector<Plan> m_plans;
+    std::optional<Plugin> m_plugin;
+    std::uint8_t m_lut[256];
+    // Whether the threshold leaves every value as it is
+    bool m_identity_lut;
+    std::vector<std::uint8_t> m_output;
+    std::vector<std::uint8_t> m_encoded;
+    Times m_times {};
+
+    Processor(Options const &opts, std::unique_ptr<double[]> mat, Pass pass, std::optional<Plugin> plugin);
+
+    // See process. With thresholded, the threshold has already been applied to src.
+    int filterAndEncode(Image const &src,
+        char const *name,
+        File::Type type,
+        std::vector<std::uint8_t> &output,
+        IncrementalFilter *frames,
+        bool thresholded);
+
+    // m_pass planned for images like image, planned on first use. Only valid until the next call.
+    Pass const &plannedPass(Image const &image);
+
+    // Maps size bytes from in through lut into out, which may be in
+    void applyLut(std::uint8_t const in[], size_t size, std::uint8_t const lut[256], std::uint8_t out[]) const noexcept;
+};
+
+// Filters a single image, see Processor. Y4M streams are passed on to processStream.
+int processImage(Options const &opts, File const &infile, File const &outfile);
+
+// Normalised size×size Gaussian matrix, owned by the caller
+double *makeGaussMat(int size, double sigma);
+
+// Rough amount of work per byte of output, in multiply-adds
+double byteCost(Options const &opts);
+
+// Rough peak memory taken by filtering a width×height image with channels (after --channels) and encoding it, in
+// bytes, apart from the encoded input
+size_t memoryFootprint(Options const &opts, int width, int height, int channels);
+
+// Hash of everything in opts which affects the output
+std::uint64_t optionsHash(Options const &opts);
+
+// Same as above, as a SHA-256 digest, for where a collision must not go unnoticed
+Digest optionsDigest(Options const &opts);
+
+#endif  // PROCESS_HPP
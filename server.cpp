@@ -0,0 +1,566 @@
+#define PRINT_FILE stderr
+
+#include "server.hpp"
+
+#include "approx.hpp"
+#include "args.hpp"
+#include "cache.hpp"
+#include "imagecache.hpp"
+#include "io.hpp"
+#include "metrics.hpp"
+#include "process.hpp"
+#include "stb_image.h"
+
+#include "print.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <format>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifdef __unix__
+#    include <atomic>
+#    include <fcntl.h>
+#    include <poll.h>
+#    include <signal.h>
+#    include <sys/resource.h>
+#    include <sys/socket.h>
+#    include <sys/un.h>
+#    include <unistd.h>
+
+#    ifdef _OPENMP
+#        include <omp.h>
+#    endif
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+// Requests are a single line, far shorter than this
+constexpr size_t max_request = 1 << 16;
+// How often metrics are rewritten
+constexpr auto metrics_interval = std::chrono::seconds(1);
+// A client which has not sent its request by then is answered with a failure
+constexpr auto read_timeout = std::chrono::seconds(5);
+// New connections taken per turn of the loop, so that a flood of them cannot keep requests from being served
+constexpr int max_accepts = 16;
+// Connections open at once, further ones wait in the listen backlog
+constexpr size_t max_connections = 256;
+// Processors kept for requests with the same options
+constexpr size_t max_processors = 8;
+
+enum Stage { Queue, Decode, Filter, Encode, Write, Total, StageCount };
+constexpr std::array<char const *, StageCount> stage_names {"queue", "decode", "filter", "encode", "write", "total"};
+
+double seconds(Clock::duration d) noexcept {
+    return std::chrono::duration<double>(d).count();
+}
+
+// CPU time used by all threads of the process so far
+double cpuSeconds() noexcept {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return double(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)
+         + double(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+int threads() noexcept {
+#    ifdef _OPENMP
+    return omp_get_max_threads();
+#    else
+    return 1;
+#    endif
+}
+
+// Levels of approximation, in the order they are tried in
+constexpr std::array approx_levels {Approx::None, Approx::Truncated, Approx::HalfRes};
+constexpr std::array<char const *, approx_levels.size()> approx_labels {"none", "truncated", "half_res"};
+
+struct Request {
+    // Options point into the arguments, so a request has to stay in place
+    std::vector<std::string> fields;
+    char const *input;
+    char const *output;
+    Options opts;
+};
+
+// A connection which was accepted and is waiting to be served
+struct Pending {
+    int fd;
+    // nullptr if the request could not be read or parsed
+    std::unique_ptr<Request> request;
+    Clock::time_point accepted;
+    // Clock::time_point::max() without a deadline
+    Clock::time_point deadline;
+    int priority;
+};
+
+// Whether a should be served before b: higher priority first, then earliest deadline first, then in order of arrival
+bool before(Pending const &a, Pending const &b) noexcept {
+    if (a.priority != b.priority) return a.priority > b.priority;
+    if (a.deadline != b.deadline) return a.deadline < b.deadline;
+    return a.accepted < b.accepted;
+}
+
+std::atomic<bool> interrupted = false;
+
+void interrupt(int) {
+    interrupted = true;
+}
+
+class Server {
+public:
+    Server(char const *program, size_t cache_bytes, size_t memory)
+            : m_program(program)
+            , m_images(memory ? std::min(cache_bytes, memory) : cache_bytes)
+            , m_memory(memory) { }
+
+    // Prints the reason and returns nullptr if line is not a valid request
+    std::unique_ptr<Request> parse(std::string const &line) {
+        auto request = std::make_unique<Request>();
+        if (!splitArgs(line, request->fields) || request->fields.size() < 2) {
+            println("Bad request '{}'", line);
+            return nullptr;
+        }
+        std::vector<char *> argv {m_program.data()};
+        for (auto &field : request->fields)
+            argv.push_back(field.data());
+        auto const parsed = tryArgs(int(argv.size()), argv.data());
+        if (!parsed) return nullptr;
+        std::tie(request->input, request->output, request->opts) = *parsed;
+        return request;
+    }
+
+    // Handles one request and keeps its statistics, returns its exit status
+    int handle(Pending const &pending) {
+        auto const started = Clock::now();
+        m_stages[Queue].observe(seconds(started - pending.accepted));
+        auto const status = pending.request ? serve(*pending.request, pending.deadline) : 1;
+        auto const finished = Clock::now();
+        m_stages[Total].observe(seconds(finished - started));
+        m_busy += seconds(finished - started);
+        (status ? m_failed : m_succeeded)++;
+        if (pending.deadline != Clock::time_point::max()) {
+            m_deadlines++;
+            m_missed += finished > pending.deadline;
+        }
+        return status;
+    }
+
+    // Everything counted so far in the Prometheus text format
+    std::string metrics(size_t queued) {
+        auto const now = Clock::now();
+        auto const cpu = cpuSeconds();
+        // Over the time since the last call, so that it shows the current load rather than the average since start
+        auto const wall = seconds(now - m_last_sample);
+        auto const utilization = wall > 0 ? (cpu - m_last_cpu) / (wall * threads()) : 0.;
+        m_last_sample = now;
+        m_last_cpu = cpu;
+
+        std::string out;
+        auto const add = [&](char const *name, char const *type, char const *help, auto value) {
+            metrics::describe(out, name, type, help);
+            std::format_to(std::back_inserter(out), "{} {}\n", name, value);
+        };
+        metrics::describe(out, "convolve_requests_total", "counter", "Requests served, by outcome.");
+        std::format_to(std::back_inserter(out), "convolve_requests_total{{status=\"ok\"}} {}\n", m_succeeded);
+        std::format_to(std::back_inserter(out), "convolve_requests_total{{status=\"error\"}} {}\n", m_failed);
+        add("convolve_input_bytes_total", "counter", "Size of the input files of successful requests.", m_bytes_in);
+        add("convolve_output_bytes_total", "counter", "Size of the outputs written.", m_bytes_out);
+        add("convolve_queue_depth", "gauge", "Connections accepted and waiting to be served.", queued);
+        metrics::describe(out,
+            "convolve_stage_seconds",
+            "histogram",
+            "Time spent in each stage of a request. decode includes reading the file, and is only counted, like filter "
+            "and encode, for requests which do not use the output cache.");
+        for (size_t i = 0; i < StageCount; i++)
+            m_stages[i].render(out, "convolve_stage_seconds", std::format("stage=\"{}\"", stage_names[i]));
+        add("convolve_deadline_requests_total", "counter", "Requests which had a deadline.", m_deadlines);
+        add("convolve_deadline_missed_total", "counter", "Requests which were done after their deadline.", m_missed);
+        metrics::describe(out,
+            "convolve_approximated_total",
+            "counter",
+            "Requests with a deadline, by how they were approximated to meet it.");
+        for (size_t i = 0; i < approx_levels.size(); i++)
+            std::format_to(std::back_inserter(out),
+                "convolve_approximated_total{{level=\"{}\"}} {}\n",
+                approx_labels[i],
+                m_approximated[i]);
+        add("convolve_refused_total", "counter", "Requests which would not fit into the memory budget.", m_refused);
+        add("convolve_memory_budget_bytes", "gauge", "Memory budget, 0 for none.", m_memory);
+        add("convolve_decoded_cache_hits_total", "counter", "Images found in the decoded cache.", m_images.hits());
+        add("convolve_decoded_cache_misses_total", "counter", "Images which had to be decoded.", m_images.misses());
+        add("convolve_decoded_cache_bytes", "gauge", "Memory taken up by decoded images.", m_images.bytes());
+        add("convolve_threads", "gauge", "Threads used to filter each image.", threads());
+        add("convolve_cpu_seconds_total", "counter", "CPU time used by all threads.", cpu);
+        add("convolve_busy_seconds_total", "counter", "Wall time spent serving requests.", m_busy);
+        add("convolve_thread_utilization",
+            "gauge",
+            "Share of the threads kept busy since the metrics were last written, from 0 to 1.",
+            utilization);
+        return out;
+    }
+
+    void report() const {
+        println("{} requests. Decoded images: {} hits, {} misses, {} MiB cached.",
+            m_succeeded + m_failed,
+            m_images.hits(),
+            m_images.misses(),
+            m_images.bytes() >> 20);
+    }
+
+private:
+    std::string m_program;
+    std::string m_cache_dir;
+    ImageCache m_images;
+    size_t m_memory;
+    size_t m_refused = 0;
+    size_t m_succeeded = 0;
+    size_t m_failed = 0;
+    std::uintmax_t m_bytes_in = 0;
+    std::uintmax_t m_bytes_out = 0;
+    std::array<metrics::Histogram, StageCount> m_stages;
+    double m_busy = 0;
+    Clock::time_point m_last_sample = Clock::now();
+    double m_last_cpu = cpuSeconds();
+    size_t m_deadlines = 0;
+    size_t m_missed = 0;
+    std::array<size_t, approx_levels.size()> m_approximated {};
+    // Learned from requests served so far, for predicting whether a request will meet its deadline. Starts out at
+    // about a billion multiply-adds per second.
+    double m_seconds_per_unit = 1e-9;
+
+    // Set up processors, which own a copy of the strings of their options as requests do not outlive being served
+    struct CachedProcessor {
+        std::uint64_t key;
+        Digest digest;
+        std::deque<std::string> strings;
+        std::optional<Processor> processor;
+    };
+    // Most recently used first
+    std::list<CachedProcessor> m_processors;
+
+    // The processor for opts, which is only set up for the first request with them, so that the rest skip building
+    // kernels, loading plugins and planning. Prints the reason and returns nullptr if opts cannot be used.
+    Processor *processorFor(Options const &opts) {
+        // Only what the processor itself depends on
+        auto const key = Hasher {}.add(optionsHash(opts)).add(opts.shards).add(opts.cache_outputs).state;
+        auto const digest = optionsDigest(opts);
+        for (auto it = m_processors.begin(); it != m_processors.end(); ++it)
+            if (it->key == key && it->digest == digest) {
+                m_processors.splice(m_processors.begin(), m_processors, it);
+                return &*it->processor;
+            }
+
+        auto &entry = m_processors.emplace_front(CachedProcessor {key, digest, {}, std::nullopt});
+        auto owned = opts;
+        for (auto const member : option_strings)
+            if (owned.*member) owned.*member = entry.strings.emplace_back(owned.*member).c_str();
+        entry.processor = Processor::create(owned);
+        if (!entry.processor) {
+            m_processors.pop_front();
+            return nullptr;
+        }
+        if (m_processors.size() > max_processors) m_processors.pop_back();
+        return &*entry.processor;
+    }
+
+    int serve(Request const &request, Clock::time_point deadline) {
+        auto const started = Clock::now();
+        auto const &[fields, input, output, opts] = request;
+        auto const is_file = [](std::string_view name) {
+            return !name.starts_with('-') && !name.starts_with("shm:");
+        };
+        if (std::error_code ec; !is_file(input) || !is_file(output) || fs::is_directory(input, ec) || opts.watch
+                                || opts.temporal != Temporal::None) {
+            println("Requests have to be single image files: {} {}", input, output);
+            return 1;
+        }
+        // The disk cache is shared by the whole process
+        if (opts.cache_dir) {
+            if (m_cache_dir.empty()) {
+                diskcache::enable(opts.cache_dir);
+                m_cache_dir = opts.cache_dir;
+            } else if (m_cache_dir != opts.cache_dir) {
+                println("All requests have to use the same cache directory");
+                return 1;
+            }
+        }
+        auto type = File::typeFromName(output);
+        if (type == File::Type::Invalid) type = File::typeFromName(input);
+        if (type == File::Type::Invalid || type == File::Type::Y4m) {
+            println("Could not tell which format to write {} in", output);
+            return 1;
+        }
+
+        // Only the header, the image may not have to be decoded at all
+        int width, height, channels;
+        auto const probed = stbi_info(input, &width, &height, &channels) != 0;
+        if (opts.channels) channels = opts.channels;
+        auto const bytes = probed ? double(width) * height * channels : 0.;
+
+        auto const [approx, plan] = planDeadline(opts, bytes, deadline, started);
+        if (deadline != Clock::time_point::max()) m_approximated[size_t(approx)]++;
+        if (approx != Approx::None)
+            println("input image {}: would miss its deadline, approximating ({}).", input, approxName(approx));
+
+        if (m_memory && probed) {
+            std::error_code ec;
+            auto const encoded = fs::file_size(input, ec);
+            auto const needed = memoryFootprint(plan, width, height, channels) + (ec ? 0 : size_t(encoded));
+            // Nothing else is running, so only the cache can make room
+            if (needed > m_memory) {
+                println("input image {}: needs about {} MiB, more than the memory budget", input, needed >> 20);
+                m_refused++;
+                return 1;
+            }
+            // Processors hold on to the buffers of the last image they filtered, which the budget does not count, so
+            // they go when room has to be made
+            if (m_images.bytes() > m_memory - needed) {
+                m_images.shrink(m_memory - needed);
+                m_processors.clear();
+            }
+        }
+
+        auto *const processor = processorFor(plan);
+        if (!processor) return 1;
+        // Outputs are cached by the encoded input, which is not kept. Approximations are not worth keeping.
+        std::error_code ec;
+        if (opts.cache_outputs && approx == Approx::None) {
+            auto const infile = File::tryOpen(input, File::Mode::Read);
+            if (!infile) return 1;
+            auto const outfile = File::tryOpen(output, File::Mode::Write, type);
+            if (!outfile) return 1;
+            if (auto const status = processor->process(*infile, *outfile)) return status;
+            if (auto const size = fs::file_size(input, ec); !ec) m_bytes_in += size;
+            if (auto const size = fs::file_size(output, ec); !ec) m_bytes_out += size;
+            return 0;
+        }
+        auto const decoded = m_images.get(input, opts.channels);
+        if (!decoded) return 1;
+        m_stages[Decode].observe(seconds(Clock::now() - started));
+        auto const image = decoded->image();
+        // Not kept between requests, so that it does not hold on to memory outside of the budget
+        std::vector<std::uint8_t> encoded;
+        if (approx == Approx::HalfRes) {
+            if (auto const status = processHalved(*processor, image, input, type, encoded)) return status;
+        } else {
+            if (auto const status = processor->process(image, input, type, encoded)) return status;
+            m_stages[Filter].observe(processor->times().filter);
+            m_stages[Encode].observe(processor->times().encode);
+        }
+        auto const writing = Clock::now();
+        auto const outfile = File::tryOpen(output, File::Mode::Write, type);
+        if (!outfile) return 1;
+        if (!writeAll(*outfile, encoded.data(), encoded.size())) {
+            println("Could not write image to {}", output);
+            return 1;
+        }
+        auto const finished = Clock::now();
+        m_stages[Write].observe(seconds(finished - writing));
+        if (auto const size = fs::file_size(input, ec); !ec) m_bytes_in += size;
+        m_bytes_out += encoded.size();
+
+        auto const units = double(image.width) * image.height * image.channels * approxCost(plan, approx);
+        if (units > 0) m_seconds_per_unit += (seconds(finished - started) / units - m_seconds_per_unit) / 8;
+        return 0;
+    }
+
+    // The least approximate level which is predicted to finish an image of the given size by the deadline, or the
+    // cheapest level there is if none is, along with the options for it
+    std::pair<Approx, Options> planDeadline(
+        Options const &opts, double bytes, Clock::time_point deadline, Clock::time_point now) const {
+        if (deadline == Clock::time_point::max() || !bytes) return {Approx::None, opts};
+        auto const left = seconds(deadline - now);
+
+        auto best = std::pair {Approx::None, opts};
+        for (auto const approx : approx_levels) {
+            auto const plan = approximate(opts, approx);
+            if (!plan) continue;
+            best = {approx, *plan};
+            if (bytes * approxCost(*plan, approx) * m_seconds_per_unit <= left) break;
+        }
+        return best;
+    }
+
+    // Filters image at half its size and scales the result back up before encoding it into output
+    int processHalved(Processor &processor,
+        Image const &image,
+        char const *name,
+        File::Type type,
+        std::vector<std::uint8_t> &output) {
+        auto const width = image.width;
+        auto const height = image.height;
+        auto const channels = image.channels;
+        print("input image {}: ({}x{})@{}, at half resolution. Using ", name, width, height, channels);
+        processor.describe();
+        auto const started = Clock::now();
+        auto const small = halveImage(image);
+        auto const small_width = (width + 1) / 2;
+        auto const small_height = (height + 1) / 2;
+        auto small_out = std::vector<std::uint8_t>(small.size());
+        auto const source = Image {small.data(), small_width, small_height, channels};
+        if (!processor.filter(source, processor.lut(), small_out.data())) return 1;
+        auto expanded = std::vector<std::uint8_t>(size_t(width) * size_t(height) * size_t(channels));
+        expandImage(Image {small_out.data(), small_width, small_height, channels}, width, height, expanded.data());
+        auto const filtered = Clock::now();
+        if (!encodeImage(type, expanded.data(), width, height, channels, output)) {
+            println("Could not encode image {}", name);
+            return 1;
+        }
+        m_stages[Filter].observe(seconds(filtered - started));
+        m_stages[Encode].observe(seconds(Clock::now() - filtered));
+        return 0;
+    }
+};
+
+// A connection which was accepted and whose request is still being read
+struct Reading {
+    int fd;
+    Clock::time_point accepted;
+    std::string data;
+};
+
+// Reads what the client has sent so far, without blocking. Returns true once the request is complete, up to the first
+// newline or the end of the connection, and false while more is to come. data is left empty if there is no request.
+bool readSome(Reading &reading) {
+    auto &data = reading.data;
+    char buf[4096];
+    while (data.find('\n') == data.npos) {
+        auto const n = read(reading.fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return false;
+        if (n == 0) break;
+        if (n < 0 || data.size() + size_t(n) > max_request) {
+            data.clear();
+            return true;
+        }
+        data.append(buf, size_t(n));
+    }
+    data.resize(std::min(data.size(), data.find('\n')));
+    return true;
+}
+}  // namespace
+
+int runServer(char const *program, ServeOptions const &opts) {
+    auto const *const path = opts.socket;
+    sockaddr_un addr {};
+    addr.sun_family = AF_UNIX;
+    if (std::strlen(path) >= sizeof(addr.sun_path)) {
+        println("Socket path {} is too long", path);
+        return 1;
+    }
+    std::strcpy(addr.sun_path, path);
+    // Non-blocking, so that waiting connections can be taken into the queue without waiting for more
+    auto const fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        println("Could not create socket: {}", std::strerror(errno));
+        return 1;
+    }
+    // A socket left behind by a server which did not shut down cleanly
+    if (std::error_code ec; fs::is_socket(path, ec)) unlink(path);
+    if (bind(fd, reinterpret_cast<sockaddr const *>(&addr), sizeof(addr)) < 0 || listen(fd, 64) < 0) {
+        println("Could not listen on {}: {}", path, std::strerror(errno));
+        close(fd);
+        return 1;
+    }
+
+    // No SA_RESTART, so that poll returns on ^C and the socket is removed
+    struct sigaction action {};
+    action.sa_handler = interrupt;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    // Clients which hang up early are not worth dying for
+    signal(SIGPIPE, SIG_IGN);
+
+    Server server(program, opts.cache_bytes, opts.memory);
+    std::vector<Reading> reading;
+    std::deque<Pending> queue;
+    std::vector<pollfd> polled;
+    auto written = Clock::time_point {};
+    auto const writeMetrics = [&] {
+        if (!opts.metrics) return;
+        metrics::write(opts.metrics, server.metrics(queue.size()));
+        written = Clock::now();
+    };
+    writeMetrics();
+    println("Serving on {}.", path);
+    // Moves a connection whose request was read, or could not be, into the queue
+    auto const enqueue = [&](Reading const &conn) {
+        auto request = conn.data.empty() ? nullptr : server.parse(conn.data);
+        auto const deadline = request && request->opts.deadline
+                                ? conn.accepted + std::chrono::milliseconds(request->opts.deadline)
+                                : Clock::time_point::max();
+        auto const priority = request ? request->opts.priority : 0;
+        queue.push_back(Pending {conn.fd, std::move(request), conn.accepted, deadline, priority});
+    };
+    while (!interrupted) {
+        for (int n = 0; n < max_accepts && reading.size() + queue.size() < max_connections; n++) {
+            auto const client = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+            if (client < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                    println("Could not accept a connection: {}", std::strerror(errno));
+                break;
+            }
+            reading.push_back(Reading {client, Clock::now(), {}});
+        }
+
+        // A client which is slow to send its request only holds up itself
+        auto const now = Clock::now();
+        std::erase_if(reading, [&](Reading &conn) {
+            auto const complete = readSome(conn);
+            if (!complete && now - conn.accepted < read_timeout) return false;
+            if (!complete) conn.data.clear();
+            enqueue(conn);
+            return true;
+        });
+
+        if (Clock::now() - written >= metrics_interval) writeMetrics();
+        if (queue.empty()) {
+            // Until a connection or more of a request arrives, a request times out, or metrics are due
+            Clock::duration wait = metrics_interval;
+            polled.clear();
+            if (reading.size() < max_connections) polled.push_back(pollfd {fd, POLLIN, 0});
+            for (auto const &conn : reading) {
+                polled.push_back(pollfd {conn.fd, POLLIN, 0});
+                wait = std::min(wait, conn.accepted + read_timeout - now);
+            }
+            auto const timeout = std::chrono::ceil<std::chrono::milliseconds>(std::max(wait, Clock::duration {}));
+            poll(polled.data(), nfds_t(polled.size()), int(timeout.count()));
+            continue;
+        }
+
+        auto const next = std::min_element(queue.begin(), queue.end(), before);
+        auto const pending = std::move(*next);
+        queue.erase(next);
+        auto const status = server.handle(pending);
+        auto const reply = std::format("{}\n", status);
+        if (write(pending.fd, reply.data(), reply.size()) < 0) { }
+        close(pending.fd);
+    }
+    for (auto const &conn : reading)
+        close(conn.fd);
+    for (auto const &pending : queue)
+        close(pending.fd);
+    queue.clear();
+    close(fd);
+    unlink(path);
+    writeMetrics();
+    server.report();
+    return 0;
+}
+#else
+int runServer(char const *, ServeOptions const &) {
+    println("--serve is only supported on Unix");
+    return 1;
+}
+#endif
@@ -0,0 +1,23 @@
+#ifndef SERVER_HPP
+#define SERVER_HPP
+
+#include "args.hpp"
+
+// Serves requests on the Unix socket at opts.socket until interrupted. Every connection sends one line of INFILE
+// OUTFILE [OPTS], with the same options as on the command line, and is answered with a line holding the exit status.
+// Requests have to be single image files, and all of them have to use the same cache directory.
+//
+// Decoded images are kept in memory, up to opts.cache_bytes, so that filtering the same image again with different
+// options skips reading and decoding it. With opts.metrics, counters, latency histograms, the queue depth and CPU use
+// are written there in the Prometheus text format about once a second.
+//
+// Processors for the most recently used sets of options are kept as well, so that requests with the same options do
+// not set up kernels, plugins and plans again.
+//
+// Requests are served one at a time. With opts.memory, decoded images are dropped to make room for the estimated peak
+// of each request, along with the kept processors, and requests which would not fit on their own are refused.
+//
+// Returns the exit status for main.
+int runServer(char const *program, ServeOptions const &opts);
+
+#endif  // SERVER_HPP
@@ -0,0 +1,242 @@
+#define PRINT_FILE stderr
+
+#include "shard.hpp"
+
+#include "cache.hpp"
+#include "process.hpp"
+
+#include "print.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <limits>
+#include <string>
+#include <vector>
+
+#ifdef _OPENMP
+#    include <omp.h>
+#endif
+
+#ifdef __unix__
+#    include <sched.h>
+#    include <spawn.h>
+#    include <sys/socket.h>
+#    include <sys/wait.h>
+#    include <unistd.h>
+
+namespace {
+struct Worker {
+    pid_t pid;
+    int fd;
+    int y0, y1;
+};
+
+// Sent to a worker after the options. It is followed by the CPUs the worker is pinned to, then by the rows of the band.
+struct BandSpec {
+    int width;
+    int rows;
+    int channels;
+    // The worker's own rows within the band, the others are halo
+    int first;
+    int count;
+    int cpus;
+};
+
+constexpr auto no_string = std::numeric_limits<std::uint32_t>::max();
+
+bool sendAll(int fd, void const *data, size_t size) {
+    auto const *bytes = static_cast<std::uint8_t const *>(data);
+    while (size) {
+        // A worker which died fails the shard instead of killing this process with SIGPIPE
+        auto const n = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        bytes += n;
+        size -= size_t(n);
+    }
+    return true;
+}
+
+bool receiveAll(int fd, void *data, size_t size) {
+    auto *bytes = static_cast<std::uint8_t *>(data);
+    while (size) {
+        auto const n = read(fd, bytes, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        bytes += n;
+        size -= size_t(n);
+    }
+    return true;
+}
+
+// The options are followed by each of their strings
+bool sendOptions(int fd, Options const &opts) {
+    if (!sendAll(fd, &opts, sizeof(opts))) return false;
+    for (auto const member : option_strings) {
+        auto const *const str = opts.*member;
+        auto const len = str ? std::uint32_t(std::strlen(str)) : no_string;
+        if (!sendAll(fd, &len, sizeof(len)) || (str && !sendAll(fd, str, len))) return false;
+    }
+    return true;
+}
+
+// The strings of opts point into storage
+bool receiveOptions(int fd, Options &opts, std::deque<std::string> &storage) {
+    if (!receiveAll(fd, &opts, sizeof(opts))) return false;
+    for (auto const member : option_strings) {
+        std::uint32_t len;
+        if (!receiveAll(fd, &len, sizeof(len))) return false;
+        opts.*member = nullptr;
+        if (len == no_string) continue;
+        auto &str = storage.emplace_back(len, '\0');
+        if (!receiveAll(fd, str.data(), len)) return false;
+        opts.*member = str.c_str();
+    }
+    return true;
+}
+
+// CPUs this process may run on
+std::vector<int> availableCpus() {
+    std::vector<int> cpus;
+#    ifdef __linux__
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+#    endif
+    return cpus;
+}
+
+// Restricts this process, and its threads, to cpus
+void pin(std::vector<int> const &cpus) {
+    if (cpus.empty()) return;
+#    ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (auto const cpu : cpus)
+        if (cpu >= 0 && cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+#    endif
+#    ifdef _OPENMP
+    omp_set_num_threads(int(cpus.size()));
+#    endif
+}
+
+// Starts a worker with fd as its stdin and stdout, returns its pid or -1
+pid_t spawnWorker(int fd) {
+    posix_spawn_file_actions_t actions;
+    if (posix_spawn_file_actions_init(&actions)) return -1;
+    posix_spawn_file_actions_adddup2(&actions, fd, STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, fd, STDOUT_FILENO);
+    char arg0[] = "convolve";
+    char arg1[sizeof(shard_worker_arg)];
+    std::memcpy(arg1, shard_worker_arg, sizeof(arg1));
+    char *argv[] = {arg0, arg1, nullptr};
+    pid_t pid;
+    auto const error = posix_spawn(&pid, "/proc/self/exe", &actions, nullptr, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return pid;
+}
+}  // namespace
+
+bool filterSharded(Processor &processor, Image const &image, std::uint8_t out[], int shards) {
+    auto const halo = processor.halo();
+    shards = std::min(shards, image.height);
+    if (halo < 0 || shards < 2) return processor.filter(image, processor.lut(), out);
+
+    auto const row_len = size_t(image.width) * size_t(image.channels);
+    auto const cpus = availableCpus();
+    auto const cpu_count = std::int64_t(cpus.size());
+    std::vector<Worker> workers;
+    auto ok = true;
+    for (int i = 0; i < shards; i++) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+            println("Could not create a socket for shard {}: {}", i, std::strerror(errno));
+            ok = false;
+            break;
+        }
+        auto const pid = spawnWorker(fds[1]);
+        close(fds[1]);
+        if (pid < 0) {
+            println("Could not start shard {}: {}", i, std::strerror(errno));
+            close(fds[0]);
+            ok = false;
+            break;
+        }
+        auto const y0 = int(std::int64_t(image.height) * i / shards);
+        auto const y1 = int(std::int64_t(image.height) * (i + 1) / shards);
+        workers.push_back(Worker {pid, fds[0], y0, y1});
+    }
+
+    // Workers filter as soon as they have their band, while the next ones are sent theirs
+    for (size_t i = 0; ok && i < workers.size(); i++) {
+        auto const &worker = workers[i];
+        auto const top = std::max(0, worker.y0 - halo);
+        auto const bottom = std::min(image.height, worker.y1 + halo);
+        // With more shards than CPUs, workers share them
+        auto const first = cpus.begin() + cpu_count * std::int64_t(i) / shards;
+        auto const last = std::max(cpus.begin() + cpu_count * std::int64_t(i + 1) / shards, first + (cpu_count > 0));
+        auto const share = std::vector<int>(first, last);
+        auto const spec = BandSpec {
+            image.width, bottom - top, image.channels, worker.y0 - top, worker.y1 - worker.y0, int(share.size())};
+        ok = sendOptions(worker.fd, processor.options()) && sendAll(worker.fd, &spec, sizeof(spec))
+          && sendAll(worker.fd, share.data(), share.size() * sizeof(int))
+          && sendAll(worker.fd, image.data + size_t(top) * row_len, size_t(bottom - top) * row_len);
+    }
+
+    // Workers which are done wait until their rows are taken. Closing the socket stops any which are not needed.
+    for (auto const &worker : workers) {
+        ok = ok
+          && receiveAll(worker.fd, out + size_t(worker.y0) * row_len, size_t(worker.y1 - worker.y0) * row_len);
+        close(worker.fd);
+        int status = 0;
+        while (waitpid(worker.pid, &status, 0) < 0 && errno == EINTR) { }
+        ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+    if (!ok) println("Filtering in {} shards failed", shards);
+    return ok;
+}
+
+int runShardWorker() {
+    Options opts;
+    std::deque<std::string> storage;
+    BandSpec spec;
+    if (!receiveOptions(STDIN_FILENO, opts, storage) || !receiveAll(STDIN_FILENO, &spec, sizeof(spec))) return 1;
+    if (spec.width <= 0 || spec.rows <= 0 || spec.channels <= 0 || spec.first < 0 || spec.count < 0
+        || spec.first + spec.count > spec.rows || spec.cpus < 0)
+        return 1;
+    std::vector<int> cpus(size_t(spec.cpus));
+    if (!receiveAll(STDIN_FILENO, cpus.data(), cpus.size() * sizeof(int))) return 1;
+    pin(cpus);
+
+    // The band is filtered here, not split up any further
+    opts.shards = 1;
+    opts.cache_outputs = false;
+    if (opts.cache_dir) diskcache::enable(opts.cache_dir);
+    auto processor = Processor::create(opts);
+    if (!processor) return 1;
+
+    auto const row_len = size_t(spec.width) * size_t(spec.channels);
+    std::vector<std::uint8_t> band(size_t(spec.rows) * row_len);
+    if (!receiveAll(STDIN_FILENO, band.data(), band.size())) return 1;
+    std::vector<std::uint8_t> result(band.size());
+    if (!processor->filter(Image {band.data(), spec.width, spec.rows, spec.channels}, processor->lut(), result.data()))
+        return 1;
+    return sendAll(STDOUT_FILENO, result.data() + size_t(spec.first) * row_len, size_t(spec.count) * row_len) ? 0 : 1;
+}
+#else
+bool filterSharded(Processor &processor, Image const &image, std::uint8_t out[], int) {
+    return processor.filter(image, processor.lut(), out);
+}
+
+int runShardWorker() {
+    return 1;
+}
+#endif
@@ -0,0 +1,30 @@
+#ifndef SHARD_HPP
+#define SHARD_HPP
+
+#include "filter.hpp"
+
+#include <cstdint>
+
+class Processor;
+
+// Filters image with processor into out in shards worker processes. Each worker filters a band of rows, together with
+// the rows its halo reaches into, and is pinned to an even share of the CPUs the tool may run on, so that a band stays
+// on one NUMA node.
+//
+// Workers are new instances of the executable rather than forks, which would inherit the OpenMP thread pool in a state
+// it cannot recover from. Each one is sent the options, its band and its CPUs over a socket, and sends back its rows of
+// the output, so a worker only ever holds its band, the halo around it and its output. The image itself is still
+// decoded and encoded whole in this process, as the codecs need all of it, so sharding spreads the filtering of a
+// large image but does not let the image get past the memory limit of this process.
+//
+// Filters which are not local, and images with fewer rows than shards, are filtered as usual in this process. Prints
+// the reason and returns false if a worker failed.
+bool filterSharded(Processor &processor, Image const &image, std::uint8_t out[], int shards);
+
+// Runs a worker started by filterSharded, on the socket it was given as stdin and stdout. Returns the exit status.
+int runShardWorker();
+
+// Argument filterSharded starts workers with
+inline constexpr char const shard_worker_arg[] = "--shard-worker";
+
+#endif  // SHARD_HPP
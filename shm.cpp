@@ -0,0 +1,203 @@
+#define PRINT_FILE stderr
+
+#include "shm.hpp"
+
+#include "incremental.hpp"
+#include "process.hpp"
+#include "shm.h"
+#include "temporal.hpp"
+
+#include "print.hpp"
+
+#include <cstring>
+#include <optional>
+#include <vector>
+
+#ifdef __linux__
+#    include <atomic>
+#    include <cerrno>
+#    include <climits>
+#    include <fcntl.h>
+#    include <linux/futex.h>
+#    include <sys/mman.h>
+#    include <sys/stat.h>
+#    include <sys/syscall.h>
+#    include <unistd.h>
+
+namespace {
+// A mapped segment, see shm.h
+class Segment {
+public:
+    // Prints the reason and returns nullopt on failure
+    static std::optional<Segment> open(char const *name) {
+        auto const fd = shm_open(name, O_RDWR, 0);
+        if (fd < 0) {
+            println("Could not open shared memory {}: {}", name, std::strerror(errno));
+            return std::nullopt;
+        }
+        struct stat st;
+        auto const ok = fstat(fd, &st) == 0;
+        auto const size = ok ? size_t(st.st_size) : 0;
+        auto *const base = size >= CONVOLVE_SHM_DATA_OFFSET
+                             ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                             : MAP_FAILED;
+        close(fd);
+        if (base == MAP_FAILED) {
+            println("Could not map shared memory {}: {}", name, ok ? "too small" : std::strerror(errno));
+            return std::nullopt;
+        }
+        auto segment = Segment(base, size);
+        if (segment.header().magic != CONVOLVE_SHM_MAGIC) {
+            println("Shared memory {} does not start with a convolve_shm_header", name);
+            return std::nullopt;
+        }
+        return segment;
+    }
+
+    Segment(Segment const &) = delete;
+    Segment &operator=(Segment const &) = delete;
+
+    Segment(Segment &&other) noexcept
+            : m_base(MAP_FAILED)
+            , m_size(0) {
+        *this = std::move(other);
+    }
+
+    Segment &operator=(Segment &&other) noexcept {
+        if (this == &other) return *this;
+        std::swap(m_base, other.m_base);
+        std::swap(m_size, other.m_size);
+        return *this;
+    }
+
+    ~Segment() noexcept {
+        if (m_base != MAP_FAILED) munmap(m_base, m_size);
+    }
+
+    convolve_shm_header &header() const noexcept {
+        return *static_cast<convolve_shm_header *>(m_base);
+    }
+
+    std::uint8_t *data() const noexcept {
+        return static_cast<std::uint8_t *>(m_base) + CONVOLVE_SHM_DATA_OFFSET;
+    }
+
+    size_t capacity() const noexcept {
+        return m_size - CONVOLVE_SHM_DATA_OFFSET;
+    }
+
+    // Blocks while the state is from, and returns the new one
+    std::uint32_t waitWhile(std::uint32_t from) const noexcept {
+        auto const state = std::atomic_ref(header().state);
+        std::uint32_t now;
+        while ((now = state.load(std::memory_order_acquire)) == from)
+            syscall(SYS_futex, &header().state, FUTEX_WAIT, from, nullptr, nullptr, 0);
+        return now;
+    }
+
+    void set(std::uint32_t to) const noexcept {
+        std::atomic_ref(header().state).store(to, std::memory_order_release);
+        syscall(SYS_futex, &header().state, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+    }
+
+private:
+    void *m_base;
+    size_t m_size;
+
+    Segment(void *base, size_t size)
+            : m_base(base)
+            , m_size(size) { }
+};
+
+// Whether rows of row_len bytes, stride apart, fit into capacity
+bool fits(int height, size_t row_len, size_t stride, size_t capacity) {
+    return stride >= row_len && stride * size_t(height - 1) + row_len <= capacity;
+}
+
+// Copies rows of row_len bytes between buffers with different strides
+void copyRows(std::uint8_t *dst, size_t dst_stride, std::uint8_t const *src, size_t src_stride, int height,
+    size_t row_len) {
+    for (int y = 0; y < height; y++)
+        std::memcpy(dst + size_t(y) * dst_stride, src + size_t(y) * src_stride, row_len);
+}
+}  // namespace
+
+int processSharedMemory(Options const &opts, char const *input, char const *output) {
+    auto processor = Processor::create(opts);
+    if (!processor) return 1;
+    auto const in = Segment::open(input);
+    if (!in) return 1;
+    auto const out = Segment::open(output);
+    if (!out) return 1;
+
+    print("input shared memory {}. Using ", input);
+    processor->describe();
+    auto frames = opts.diff_frames ? std::make_optional<IncrementalFilter>() : std::nullopt;
+    auto temporal = TemporalFilter(opts.temporal, opts.window, opts.time_sigma);
+    // Only used where the frame cannot be filtered in place
+    std::vector<std::uint8_t> packed, smoothed, result;
+
+    auto const fail = [&](int count, char const *why) {
+        println("Frame {} in shared memory {} {}", count, input, why);
+        in->set(CONVOLVE_SHM_EMPTY);
+        out->set(CONVOLVE_SHM_CLOSED);
+        return 1;
+    };
+    int count = 0;
+    for (; in->waitWhile(CONVOLVE_SHM_EMPTY) == CONVOLVE_SHM_FULL; count++) {
+        auto const &header = in->header();
+        auto const width = int(header.width);
+        auto const height = int(header.height);
+        auto const channels = int(header.channels);
+        auto const row_len = size_t(width) * size_t(channels);
+        auto const in_stride = header.stride ? size_t(header.stride) : row_len;
+        if (width <= 0 || height <= 0 || channels < 1 || channels > 4)
+            return fail(count, "has an invalid size");
+        if (!fits(height, row_len, in_stride, in->capacity())) return fail(count, "is larger than the segment");
+
+        // Private copies let the producer go on with the next frame while this one is filtered
+        auto src = Image {in->data(), width, height, channels};
+        auto const size = row_len * size_t(height);
+        if (in_stride != row_len) {
+            packed.resize(size);
+            copyRows(packed.data(), row_len, in->data(), in_stride, height, row_len);
+            src.data = packed.data();
+        }
+        if (opts.temporal != Temporal::None) {
+            smoothed.resize(size);
+            temporal.apply(src.data, size, smoothed.data());
+            src.data = smoothed.data();
+        }
+        auto const in_place = src.data == in->data();
+        if (!in_place) in->set(CONVOLVE_SHM_EMPTY);
+
+        out->waitWhile(CONVOLVE_SHM_FULL);
+        auto &out_header = out->header();
+        auto const out_stride = out_header.stride ? size_t(out_header.stride) : row_len;
+        if (!fits(height, row_len, out_stride, out->capacity())) return fail(count, "does not fit into the output");
+        if (out_stride != row_len) result.resize(size);
+        auto *const dst = out_stride == row_len ? out->data() : result.data();
+        if (!processor->filter(src, processor->lut(), dst, frames ? &*frames : nullptr))
+            return fail(count, "could not be filtered");
+        if (in_place) in->set(CONVOLVE_SHM_EMPTY);
+        if (dst != out->data()) copyRows(out->data(), out_stride, dst, row_len, height, row_len);
+
+        // The input header may already belong to the next frame
+        out_header.width = std::uint32_t(width);
+        out_header.height = std::uint32_t(height);
+        out_header.channels = std::uint32_t(channels);
+        out_header.stride = std::uint32_t(out_stride);
+        out->set(CONVOLVE_SHM_FULL);
+    }
+    // The last frame is left for the reader before closing
+    out->waitWhile(CONVOLVE_SHM_FULL);
+    out->set(CONVOLVE_SHM_CLOSED);
+    println("Filtered {} frames.", count);
+    return 0;
+}
+#else
+int processSharedMemory(Options const &, char const *, char const *) {
+    println("Shared memory is only supported on Linux");
+    return 1;
+}
+#endif
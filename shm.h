@@ -0,0 +1,49 @@
+/* Shared memory frame exchange.
+ *
+ * With `convolve shm:INPUT shm:OUTPUT [OPTS]`, frames are taken from, and filtered into, the POSIX shared memory
+ * objects INPUT and OUTPUT (as passed to shm_open, e.g. /camera). Both are created by the other side, sized to hold
+ * the largest frame after the header, and start out with the header zeroed apart from the magic. convolve keeps
+ * running until the input is closed.
+ *
+ * Every segment starts with a convolve_shm_header, and the pixels follow at CONVOLVE_SHM_DATA_OFFSET, interleaved,
+ * row by row. `state` is a futex word (shared, i.e. without FUTEX_PRIVATE_FLAG) owned alternately by the writer and
+ * the reader of the segment:
+ *
+ *   writer: waits while the state is FULL, writes the pixels and the rest of the header, sets FULL and wakes
+ *   reader: waits while the state is EMPTY, reads the frame, sets EMPTY and wakes
+ *
+ * The writer sets CLOSED instead of FULL once there are no more frames. convolve closes its output when its input is
+ * closed. Header fields other than state are only written by the writer, before it sets FULL.
+ */
+#ifndef CONVOLVE_SHM_H
+#define CONVOLVE_SHM_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CONVOLVE_SHM_MAGIC 0x6d687363u /* "cshm" */
+#define CONVOLVE_SHM_DATA_OFFSET 64
+
+enum convolve_shm_state {
+    CONVOLVE_SHM_EMPTY = 0,
+    CONVOLVE_SHM_FULL = 1,
+    CONVOLVE_SHM_CLOSED = 2,
+};
+
+struct convolve_shm_header {
+    uint32_t magic;    /* CONVOLVE_SHM_MAGIC */
+    uint32_t state;    /* enum convolve_shm_state */
+    uint32_t width;    /* in pixels */
+    uint32_t height;   /* in pixels */
+    uint32_t channels; /* 1 to 4 */
+    uint32_t stride;   /* bytes between rows, 0 for width * channels. The reader of the output may set it first. */
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CONVOLVE_SHM_H */
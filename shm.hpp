@@ -0,0 +1,14 @@
+#ifndef SHM_HPP
+#define SHM_HPP
+
+#include "args.hpp"
+
+// Filters frames handed over through the shared memory objects input and output (without the shm: prefix) until the
+// input is closed, see shm.h for the protocol. Frames are filtered in place in shared memory where the strides allow
+// it, and the input is handed back as soon as it has been read. The kernels and buffers, and the history for
+// --diff-frames and --temporal, are kept across frames. Only supported on Linux.
+//
+// Returns the exit status for main.
+int processSharedMemory(Options const &opts, char const *input, char const *output);
+
+#endif  // SHM_HPP
@@ -0,0 +1,81 @@
+#include "temporal.hpp"
+
+#include "process.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+
+TemporalFilter::TemporalFilter(Temporal temporal, int window, double sigma)
+        : m_temporal(temporal)
+        , m_window(window) {
+    if (temporal != Temporal::Gauss) return;
+    // Summing the columns of the matrix leaves the Gaussian along one axis. Only the half from the centre on is used,
+    // as the frames after the newest one have not arrived yet.
+    auto const size = 2 * window - 1;
+    auto const mat = std::unique_ptr<double[]>(makeGaussMat(size, sigma));
+    m_weights.resize(size_t(window));
+    for (int age = 0; age < window; age++)
+        for (int j = 0; j < size; j++)
+            m_weights[size_t(age)] += mat[size_t(j * size + window - 1 + age)];
+}
+
+void TemporalFilter::apply(std::uint8_t const frame[], size_t size, std::uint8_t out[]) {
+    if (size != m_size) {
+        m_size = size;
+        m_next = 0;
+        m_count = 0;
+        if (m_temporal == Temporal::Mean || m_temporal == Temporal::Gauss) m_ring.assign(size * size_t(m_window), 0);
+        if (m_temporal == Temporal::Mean) m_sum.assign(size, 0);
+        if (m_temporal == Temporal::Ema) m_average.assign(frame, frame + size);
+    }
+    auto *const slot = m_ring.data() + size_t(m_next) * size;
+    auto const full = m_count == m_window;
+    auto const count = std::min(m_count + 1, m_window);
+
+    switch (m_temporal) {
+        case Temporal::None: std::memcpy(out, frame, size); break;
+        case Temporal::Ema: {
+            auto const alpha = float(2. / (m_window + 1));
+#pragma omp parallel for
+            for (size_t i = 0; i < size; i++) {
+                m_average[i] += alpha * (float(frame[i]) - m_average[i]);
+                out[i] = std::uint8_t(m_average[i] + .5f);
+            }
+            break;
+        }
+        case Temporal::Mean: {
+            auto const n = std::uint32_t(count);
+#pragma omp parallel for
+            for (size_t i = 0; i < size; i++) {
+                // The frame dropping out of the window is the one being replaced
+                m_sum[i] = m_sum[i] - (full ? slot[i] : 0u) + frame[i];
+                slot[i] = frame[i];
+                out[i] = std::uint8_t((m_sum[i] + n / 2) / n);
+            }
+            break;
+        }
+        case Temporal::Gauss: {
+            std::memcpy(slot, frame, size);
+            auto frames = std::vector<std::uint8_t const *>(size_t(count));
+            auto total = 0.;
+            for (int age = 0; age < count; age++) {
+                frames[size_t(age)] = m_ring.data() + size_t((m_next - age + m_window) % m_window) * size;
+                total += m_weights[size_t(age)];
+            }
+            auto weights = std::vector<float>(size_t(count));
+            for (size_t age = 0; age < weights.size(); age++)
+                weights[age] = float(m_weights[age] / total);
+#pragma omp parallel for
+            for (size_t i = 0; i < size; i++) {
+                auto acc = 0.f;
+                for (size_t age = 0; age < frames.size(); age++)
+                    acc += weights[age] * float(frames[age][i]);
+                out[i] = std::uint8_t(std::min(acc + .5f, 255.f));
+            }
+            break;
+        }
+    }
+    m_next = (m_next + 1) % m_window;
+    m_count = count;
+}
@@ -0,0 +1,52 @@
+#ifndef TEMPORAL_HPP
+#define TEMPORAL_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// How frames are combined with the ones before them:
+//   Mean   average of the last window frames
+//   Ema    exponential moving average, each frame weighted by 2 / (window + 1)
+//   Gauss  the last window frames weighted by a Gaussian of their age, centred on the newest one
+enum struct Temporal { None, Mean, Ema, Gauss };
+
+inline constexpr char const *temporalName(Temporal temporal) noexcept {
+    switch (temporal) {
+        case Temporal::None: return "none";
+        case Temporal::Mean: return "mean";
+        case Temporal::Ema: return "ema";
+        case Temporal::Gauss: return "gauss";
+    }
+    return "unknown";
+}
+
+// Filters a sequence of frames along the time axis. Only the newest window frames are kept, in a ring, and the filter
+// is causal, so every frame comes out as soon as it goes in. Until window frames have been seen, the ones there are
+// are weighted as if they were all there was.
+//
+// The running mean and the moving average are updated with each frame rather than recomputed over the window. Frames
+// are flat arrays of bytes, any layout of planes or channels works as long as it stays the same.
+class TemporalFilter {
+public:
+    TemporalFilter(Temporal temporal, int window, double sigma);
+
+    // Adds frame to the sequence and writes the filtered frame to out. A frame of a different size restarts it.
+    void apply(std::uint8_t const frame[], size_t size, std::uint8_t out[]);
+
+private:
+    Temporal m_temporal;
+    int m_window;
+    // Weights for the Gaussian, by age
+    std::vector<double> m_weights;
+    // The last window frames, the oldest at m_next once the ring is full
+    std::vector<std::uint8_t> m_ring;
+    int m_next = 0;
+    int m_count = 0;
+    size_t m_size = 0;
+    // Sum of the frames in the ring, or the moving average
+    std::vector<std::uint32_t> m_sum;
+    std::vector<float> m_average;
+};
+
+#endif  // TEMPORAL_HPP
@@ -0,0 +1,155 @@
+#define PRINT_FILE stderr
+
+#include "y4m.hpp"
+
+#include "incremental.hpp"
+#include "process.hpp"
+#include "temporal.hpp"
+
+#include "print.hpp"
+
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace {
+// Headers are a single line, far shorter than this
+constexpr size_t max_line = 4096;
+
+struct Plane {
+    int width;
+    int height;
+};
+
+// Reads up to the next newline, which is dropped. Returns nullopt at the end of the file or for overlong lines.
+std::optional<std::string> readLine(std::FILE *fp) {
+    std::string line;
+    int ch;
+    while ((ch = std::fgetc(fp)) != EOF && ch != '\n') {
+        if (line.size() == max_line) return std::nullopt;
+        line += char(ch);
+    }
+    if (ch == EOF) return std::nullopt;
+    return line;
+}
+
+bool writeLine(std::FILE *fp, std::string const &line) {
+    return std::fwrite(line.data(), 1, line.size(), fp) == line.size() && std::fputc('\n', fp) != EOF;
+}
+
+// Planes making up a frame in the given colour space, in the order they are stored. Empty if it is not supported, which
+// includes all high bit depth ones (e.g. 420p10).
+std::vector<Plane> framePlanes(std::string_view colour, int width, int height) {
+    auto const half_w = (width + 1) / 2;
+    auto const half_h = (height + 1) / 2;
+    if (colour == "420" || colour == "420jpeg" || colour == "420mpeg2" || colour == "420paldv")
+        return {{width, height}, {half_w, half_h}, {half_w, half_h}};
+    if (colour == "422") return {{width, height}, {half_w, height}, {half_w, height}};
+    if (colour == "411") return {{width, height}, {(width + 3) / 4, height}, {(width + 3) / 4, height}};
+    if (colour == "444") return {{width, height}, {width, height}, {width, height}};
+    if (colour == "444alpha") return {{width, height}, {width, height}, {width, height}, {width, height}};
+    if (colour == "mono") return {{width, height}};
+    return {};
+}
+}  // namespace
+
+int processStream(Options const &opts, File const &infile, File const &outfile) {
+    auto processor = Processor::create(opts);
+    if (!processor) return 1;
+    auto const *const name = infile.name[0] == '-' ? "stdin" : infile.name;
+
+    auto const header = readLine(infile.fp);
+    if (!header || !header->starts_with("YUV4MPEG2 ")) {
+        println("{} is not a YUV4MPEG2 stream", name);
+        return 1;
+    }
+    auto width = 0, height = 0;
+    // The default when the stream does not say
+    std::string colour = "420jpeg";
+    std::istringstream tags(header->substr(10));
+    for (std::string tag; tags >> tag;) {
+        auto const parse = [&](int &value) {
+            std::from_chars(tag.data() + 1, tag.data() + tag.size(), value);
+        };
+        switch (tag[0]) {
+            case 'W': parse(width); break;
+            case 'H': parse(height); break;
+            case 'C': colour = tag.substr(1); break;
+        }
+    }
+    auto const planes = framePlanes(colour, width, height);
+    if (width <= 0 || height <= 0 || planes.empty()) {
+        println("Unsupported YUV4MPEG2 stream {}: {}", name, *header);
+        return 1;
+    }
+    if (!writeLine(outfile.fp, *header)) {
+        println("Could not write stream to {}", outfile.name);
+        return 1;
+    }
+
+    print("input stream {}: ({}x{}) {}. Using ", name, width, height, colour);
+    processor->describe();
+    if (opts.temporal != Temporal::None)
+        println("Temporal filter: {} over {} frames.", temporalName(opts.temporal), opts.window);
+    auto const grey = opts.alg == Alg::Sobel || opts.alg == Alg::Laplace;
+    std::uint8_t identity[256];
+    for (int i = 0; i < 256; i++)
+        identity[i] = std::uint8_t(i);
+
+    size_t frame_size = 0;
+    for (auto const &plane : planes)
+        frame_size += size_t(plane.width) * size_t(plane.height);
+    std::vector<std::uint8_t> input(frame_size);
+    std::vector<std::uint8_t> output(frame_size);
+    // Filtered in time first, then each plane in space
+    auto temporal = TemporalFilter(opts.temporal, opts.window, opts.time_sigma);
+    std::vector<std::uint8_t> smoothed(opts.temporal != Temporal::None ? frame_size : 0);
+    auto const *const source = smoothed.empty() ? input.data() : smoothed.data();
+    auto history = std::vector<IncrementalFilter>(opts.diff_frames ? planes.size() : 0);
+
+    int frames = 0;
+    std::optional<std::string> frame_header;
+    for (; (frame_header = readLine(infile.fp)); frames++) {
+        if (!frame_header->starts_with("FRAME")) {
+            println("Expected frame {} of {}, found '{}'", frames, name, *frame_header);
+            return 1;
+        }
+        if (std::fread(input.data(), 1, frame_size, infile.fp) != frame_size) {
+            println("Frame {} of {} is truncated", frames, name);
+            return 1;
+        }
+        if (!smoothed.empty()) temporal.apply(input.data(), frame_size, smoothed.data());
+
+        size_t offset = 0;
+        for (size_t p = 0; p < planes.size(); p++) {
+            auto const [w, h] = planes[p];
+            auto const size = size_t(w) * size_t(h);
+            auto const chroma = p == 1 || p == 2;
+            if (chroma && grey)
+                std::memset(output.data() + offset, 128, size);
+            else if (!processor->filter(Image {source + offset, w, h, 1},
+                         p == 0 ? processor->lut() : identity,
+                         output.data() + offset,
+                         history.empty() ? nullptr : &history[p]))
+                return 1;
+            offset += size;
+        }
+
+        if (!writeLine(outfile.fp, *frame_header)
+            || std::fwrite(output.data(), 1, frame_size, outfile.fp) != frame_size || std::fflush(outfile.fp)) {
+            println("Could not write stream to {}", outfile.name);
+            return 1;
+        }
+    }
+    if (!std::feof(infile.fp)) {
+        println("Could not read frame {} of {}", frames, name);
+        return 1;
+    }
+    println("Filtered {} frames.", frames);
+    return 0;
+}
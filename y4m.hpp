@@ -0,0 +1,19 @@
+#ifndef Y4M_HPP
+#define Y4M_HPP
+
+#include "args.hpp"
+#include "io.hpp"
+
+// Filters a YUV4MPEG2 stream from infile into outfile frame by frame, as it arrives, so that it can sit in a pipe line
+// between a decoder and an encoder (e.g. ffmpeg -f yuv4mpegpipe). The stream header and frame headers are passed
+// through unchanged.
+//
+// Every plane is filtered on its own at its own resolution, there is no conversion to RGB. The threshold only applies
+// to luma. Edge filters only make sense for brightness, so their chroma is set to grey. Only 8 bit streams are
+// supported. The kernels, plans and frame buffers are kept for the whole stream, and with --diff-frames each plane only
+// refilters what changed since the previous frame.
+//
+// Returns the exit status for main.
+int processStream(Options const &opts, File const &infile, File const &outfile);
+
+#endif  // Y4M_HPP